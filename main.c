@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2009-2024 Vadim Mikhailov
+ *
+ * uhubctl command line tool - thin wrapper over libuhubctl.
+ * All the real work is done in uhubctl.c, see uhubctl.h for
+ * the embeddable library API.
+ *
+ * This file can be distributed under the terms and conditions of the
+ * GNU General Public License version 2.
+ *
+ */
+
+#include "uhubctl.h"
+
+int main(int argc, char *argv[])
+{
+    return uhubctl_main(argc, argv);
+}
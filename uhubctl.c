@@ -13,6 +13,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <strings.h>
 #include <getopt.h>
@@ -28,6 +29,11 @@
 #define strncasecmp _strnicmp
 #else
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #endif
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(_WIN32)
@@ -40,9 +46,43 @@
 #define LIBUSB_DT_SUPERSPEED_HUB 0x2a
 #endif
 
+#include "uhubctl.h"
+
 #if _POSIX_C_SOURCE >= 199309L
-#include <time.h>   /* for nanosleep */
+#include <time.h>   /* for nanosleep and clock_gettime */
+#endif
+
+
+/* monotonic time in milliseconds since some arbitrary point */
+
+static int64_t get_time_ms(void)
+{
+#if defined(_WIN32)
+    return GetTickCount();
+#elif _POSIX_C_SOURCE >= 199309L
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return (int64_t)time(NULL) * 1000;
+#endif
+}
+
+
+/* monotonic time in microseconds, for --profile measurements */
+
+static int64_t get_time_us(void)
+{
+#if defined(_WIN32)
+    return (int64_t)GetTickCount() * 1000;
+#elif _POSIX_C_SOURCE >= 199309L
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return (int64_t)time(NULL) * 1000000;
 #endif
+}
 
 
 /* cross-platform sleep function */
@@ -61,11 +101,37 @@ void sleep_ms(int milliseconds)
 #endif
 }
 
+
+/*
+ * Sleep until an absolute CLOCK_MONOTONIC deadline in microseconds
+ * (same epoch as get_time_us). Unlike sleep_ms, absolute deadlines do
+ * not accumulate drift across repeated power edges and compensate for
+ * the duration of the control transfers preceding the sleep, keeping
+ * flash pulse widths and repeat intervals tight even on loaded hosts.
+ */
+
+static void sleep_until_us(int64_t deadline_us)
+{
+#if !defined(_WIN32) && _POSIX_C_SOURCE >= 200112L
+    struct timespec ts;
+    ts.tv_sec = deadline_us / 1000000;
+    ts.tv_nsec = (deadline_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+#else
+    int64_t remaining_ms = (deadline_us - get_time_us()) / 1000;
+    if (remaining_ms > 0) {
+        sleep_ms((int)remaining_ms);
+    }
+#endif
+}
+
+
 /* Max number of hub ports supported */
 #define MAX_HUB_PORTS            14
 #define ALL_HUB_PORTS            ((1 << MAX_HUB_PORTS) - 1) /* bitmask */
 
 #define USB_CTRL_GET_TIMEOUT     5000
+#define USB_STRING_FAST_TIMEOUT  200 /* initial string descriptor read timeout */
 
 #define USB_PORT_FEAT_POWER      (1 << 3)
 
@@ -76,8 +142,48 @@ void sleep_ms(int milliseconds)
 #define POWER_TOGGLE             3
 #define POWER_FLASH              4
 
+#define FORMAT_TEXT              0
+#define FORMAT_JSON              1
+#define FORMAT_TSV               2
+
 #define MAX_HUB_CHAIN            8  /* Per USB 3.0 spec max hub chain is 7 */
 
+#define POWER_POLL_INTERVAL_MS   20 /* poll interval when verifying port power state */
+
+/*
+ * Discovery deadline budget (--scan-budget): one wedged hub that stalls
+ * its GET_DESCRIPTOR reply used to block the scan for the full control
+ * timeout with no way to bound total startup time. When a budget is
+ * set, rescan_hubs() arms an absolute deadline; probe transfer timeouts
+ * are clamped to the remaining budget and probes that have not started
+ * by the deadline are skipped and reported as unprobed, so the action
+ * proceeds against the hubs that did answer.
+ */
+
+static int opt_scan_budget = 0;       /* discovery budget in ms, 0 = unlimited */
+static int64_t scan_deadline_us = 0;  /* absolute deadline of current scan, 0 = none */
+
+/* True when the scan budget is armed and already spent: */
+static int scan_budget_expired(void)
+{
+    return scan_deadline_us != 0 && get_time_us() >= scan_deadline_us;
+}
+
+/* Control transfer timeout honoring the remaining scan budget.
+ * Never returns 0 (which libusb treats as unlimited) - overshooting
+ * the deadline by a few ms beats hanging on it. */
+static int scan_timeout_ms(void)
+{
+    if (scan_deadline_us == 0) {
+        return USB_CTRL_GET_TIMEOUT;
+    }
+    int64_t left_ms = (scan_deadline_us - get_time_us()) / 1000;
+    if (left_ms < 10) {
+        return 10;
+    }
+    return left_ms < USB_CTRL_GET_TIMEOUT ? (int)left_ms : USB_CTRL_GET_TIMEOUT;
+}
+
 /* Partially borrowed from linux/usb/ch11.h */
 
 #pragma pack(push,1)
@@ -131,6 +237,7 @@ struct usb_port_status {
 #define USB_SS_PORT_STAT_POWER          0x0200
 #define USB_SS_PORT_STAT_SPEED          0x1c00
 #define USB_PORT_STAT_SPEED_5GBPS       0x0000
+#define USB_PORT_STAT_SPEED_10GBPS      0x0400
 /* Valid only if port is enabled */
 /* Bits that are the same from USB 2.0 */
 #define USB_SS_PORT_STAT_MASK (USB_PORT_STAT_CONNECTION  | \
@@ -192,19 +299,31 @@ struct hub_info {
     int nports;
     int lpsm; /* logical power switching mode */
     int actionable; /* true if this hub is subject to action */
-    char container_id[33]; /* container ID as hex string */
+#if !defined(UHUBCTL_MINIMAL)
+    uint8_t container_id[16]; /* container ID raw bytes */
+    int has_container_id;
+#endif
     char vendor[16];
     char location[32];
     uint8_t bus;
     uint8_t port_numbers[MAX_HUB_CHAIN];
     int pn_len; /* length of port numbers */
+#if !defined(UHUBCTL_MINIMAL)
     struct descriptor_strings ds;
+#endif
 };
 
-/* Array of all enumerated USB hubs */
-#define MAX_HUBS 128
-static struct hub_info hubs[MAX_HUBS];
+/* Hub description for status output; always empty in minimal builds: */
+#if defined(UHUBCTL_MINIMAL)
+#define hub_description(hub) ""
+#else
+#define hub_description(hub) ((hub)->ds.description)
+#endif
+
+/* Array of all enumerated USB hubs, grown on demand as hubs are discovered */
+static struct hub_info *hubs = NULL;
 static int hub_count = 0;
+static int hub_capacity = 0;
 static int hub_phys_count = 0;
 
 /* default options */
@@ -217,40 +336,187 @@ static int opt_action = POWER_KEEP;
 static double opt_delay = 2;
 static int opt_repeat = 1;
 static int opt_wait   = 20; /* wait before repeating in ms */
+static int64_t opt_at_deadline = 0; /* absolute deadline to start the action (--at N ms) */
 static int opt_exact  = 0;  /* exact location match - disable USB3 duality handling */
+static int opt_multi  = 0;  /* allow actions on multiple hubs at once */
+static int opt_watch  = 0;  /* watch for topology changes using hotplug events */
 static int opt_reset  = 0;  /* reset hub after operation(s) */
 static int opt_force  = 0;  /* force operation even on unsupported hubs */
 static int opt_nodesc = 0;  /* skip querying device description */
+static int opt_format = FORMAT_TEXT; /* port status output format */
 #if defined(__gnu_linux__) || defined(__linux__)
-static int opt_nosysfs = 0; /* don't use the Linux sysfs port disable interface, even if available */
+static int opt_nosysfs = 0; /* don't use the Linux sysfs port interfaces, even if available */
 #endif
+#if !defined(_WIN32)
+static char opt_daemon[104] = ""; /* daemon mode Unix socket path (limited by sockaddr_un) */
+static char opt_export[1024] = ""; /* live status export file path (mmap-able, for -W/-D) */
+#endif
+static char opt_cache[1024] = ""; /* hub topology cache file path */
+static char opt_batch[1024] = ""; /* batch action file path, `-` for stdin */
+static char opt_record[1024] = ""; /* record discovered topology to this file */
+static char opt_bench[1024] = "";  /* benchmark: synthetic hub count or recorded topology file */
 
 /* For Raspberry Pi detection and workarounds: */
 static int is_rpi_4b = 0;
 static int is_rpi_5  = 0;
 
+/*
+ * Phase profiling (--profile): lightweight monotonic-clock timers
+ * around each discovery/control phase and control transfer category,
+ * summarized to stderr on exit. Costs one branch per phase when off.
+ */
+
+static int opt_profile = 0; /* report per-phase latency summary on exit */
+
+enum prof_phase {
+    PROF_INIT,          /* libusb_init */
+    PROF_DEVICE_LIST,   /* libusb_get_device_list */
+    PROF_HUB_PROBE,     /* get_hub_info control transfers */
+    PROF_PORT_STATUS,   /* GET_STATUS, one port at a time */
+    PROF_STATUS_BATCH,  /* GET_STATUS, async batch per hub */
+    PROF_SET_STATUS,    /* SET/CLEAR_FEATURE PORT_POWER */
+    PROF_STRING_DESC,   /* string descriptor reads */
+    PROF_SETTLE,        /* power-off settle waits */
+    PROF_PHASES
+};
+
+static const char *prof_names[PROF_PHASES] = {
+    "libusb_init",
+    "device_list",
+    "hub_probe",
+    "port_status",
+    "status_batch",
+    "set_status",
+    "string_desc",
+    "settle",
+};
+
+struct prof_stat {
+    int64_t count;
+    int64_t total_us;
+    int64_t max_us;
+};
+
+static struct prof_stat prof_stats[PROF_PHASES];
+#if !defined(_WIN32)
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int64_t prof_start(void)
+{
+    return opt_profile ? get_time_us() : 0;
+}
+
+static void prof_end(enum prof_phase phase, int64_t start)
+{
+    if (!opt_profile)
+        return;
+    int64_t elapsed = get_time_us() - start;
+#if !defined(_WIN32)
+    pthread_mutex_lock(&prof_lock);
+#endif
+    struct prof_stat *st = &prof_stats[phase];
+    st->count++;
+    st->total_us += elapsed;
+    if (elapsed > st->max_us) {
+        st->max_us = elapsed;
+    }
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&prof_lock);
+#endif
+}
+
+static void prof_report(void)
+{
+    int i;
+    if (!opt_profile)
+        return;
+    fprintf(stderr, "%-12s %8s %12s %12s\n",
+        "phase", "count", "total ms", "max ms");
+    for (i=0; i<PROF_PHASES; i++) {
+        if (prof_stats[i].count == 0)
+            continue;
+        fprintf(stderr, "%-12s %8lld %12.3f %12.3f\n",
+            prof_names[i],
+            (long long)prof_stats[i].count,
+            prof_stats[i].total_us / 1000.0,
+            prof_stats[i].max_us / 1000.0);
+    }
+}
+
+/*
+ * On-disk hub topology cache (-C).
+ * Caches results of get_hub_info() and get_device_description() keyed by
+ * bus + port path + vid:pid, all of which libusb provides without any
+ * control transfers. Warm starts then need near-zero USB I/O before the
+ * action. Delete the cache file to invalidate it manually.
+ */
+
+#define HUB_CACHE_MAGIC   0x43484855 /* "UHHC" */
+#define HUB_CACHE_VERSION 2
+#define MAX_CACHE_ENTRIES 1024
+
+struct hub_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t count;
+};
+
+struct hub_cache_entry {
+    uint16_t id_vendor;
+    uint16_t id_product;
+    struct hub_info info; /* info.dev is not meaningful on disk */
+};
+
+static struct hub_cache_entry *hub_cache = NULL;
+static int hub_cache_count = 0;
+static int hub_cache_dirty = 0;
+
 static const char short_options[] =
-    "l:L:n:a:p:d:r:w:s:hvefRN"
+    "l:L:n:a:p:d:r:w:C:b:o:hvefmRNW"
+#if !defined(UHUBCTL_MINIMAL)
+    "s:"
+#endif
 #if defined(__gnu_linux__) || defined(__linux__)
     "S"
 #endif
+#if !defined(_WIN32)
+    "D:"
+#endif
 ;
 
 static const struct option long_options[] = {
     { "location", required_argument, NULL, 'l' },
     { "vendor",   required_argument, NULL, 'n' },
+#if !defined(UHUBCTL_MINIMAL)
     { "search",   required_argument, NULL, 's' },
+#endif
     { "level",    required_argument, NULL, 'L' },
     { "ports",    required_argument, NULL, 'p' },
     { "action",   required_argument, NULL, 'a' },
     { "delay",    required_argument, NULL, 'd' },
     { "repeat",   required_argument, NULL, 'r' },
     { "wait",     required_argument, NULL, 'w' },
+    { "cache",    required_argument, NULL, 'C' },
+    { "batch",    required_argument, NULL, 'b' },
+    { "format",   required_argument, NULL, 'o' },
+    { "profile",  no_argument,       &opt_profile, 1 },
+    { "record",   required_argument, NULL, 1001 },
+    { "bench",    required_argument, NULL, 1002 },
+    { "at",       required_argument, NULL, 1004 },
+    { "scan-budget", required_argument, NULL, 1005 },
     { "exact",    no_argument,       NULL, 'e' },
     { "force",    no_argument,       NULL, 'f' },
+    { "multi",    no_argument,       NULL, 'm' },
+    { "watch",    no_argument,       NULL, 'W' },
     { "nodesc",   no_argument,       NULL, 'N' },
 #if defined(__gnu_linux__) || defined(__linux__)
     { "nosysfs",  no_argument,       NULL, 'S' },
+#endif
+#if !defined(_WIN32)
+    { "daemon",   required_argument, NULL, 'D' },
+    { "export",   required_argument, NULL, 1003 },
 #endif
     { "reset",    no_argument,       NULL, 'R' },
     { "version",  no_argument,       NULL, 'v' },
@@ -272,14 +538,30 @@ static int print_usage(void)
         "--location, -l - limit hub by location  [all smart hubs].\n"
         "--level     -L - limit hub by location level (e.g. a-b.c is level 3).\n"
         "--vendor,   -n - limit hub by vendor id [%s] (partial ok).\n"
+#if !defined(UHUBCTL_MINIMAL)
         "--search,   -s - limit hub by attached device description.\n"
+#endif
         "--delay,    -d - delay for cycle/flash action [%g sec].\n"
         "--repeat,   -r - repeat power off count [%d] (some devices need it to turn off).\n"
+        "--cache,    -C - use hub topology cache file to avoid repeated USB enumeration I/O.\n"
+        "--batch,    -b - run action lines (location ports action [delay]) from file, `-` for stdin.\n"
+        "--format,   -o - port status output format text/json/tsv [text].\n"
+        "--profile      - report per-phase latency summary to stderr on exit.\n"
+        "--record       - record discovered hub topology to file, for --bench replay.\n"
+        "--bench        - benchmark matching/formatting on synthetic (N hubs) or recorded topology.\n"
+        "--at           - schedule the action N ms in the future (absolute monotonic deadline).\n"
+        "--scan-budget  - bound hub discovery to N ms, skipping hubs that do not answer in time.\n"
         "--exact,    -e - exact location (no USB3 duality handling).\n"
         "--force,    -f - force operation even on unsupported hubs.\n"
+        "--multi,    -m - allow acting on multiple hubs at once (concurrently).\n"
+        "--watch,    -W - watch for topology changes using hotplug events.\n"
         "--nodesc,   -N - do not query device description (helpful for unresponsive devices).\n"
 #if defined(__gnu_linux__) || defined(__linux__)
-        "--nosysfs,  -S - do not use the Linux sysfs port disable interface.\n"
+        "--nosysfs,  -S - do not use the Linux sysfs port interfaces (control and status).\n"
+#endif
+#if !defined(_WIN32)
+        "--daemon,   -D - run as daemon accepting commands on given Unix socket path.\n"
+        "--export       - export live hub/port status to mmap-able file (with -W or -D).\n"
 #endif
         "--reset,    -R - reset hub after each power-on action, causing all devices to reassociate.\n"
         "--wait,     -w - wait before repeat power off [%d ms].\n"
@@ -298,6 +580,7 @@ static int print_usage(void)
 }
 
 
+#if !defined(UHUBCTL_MINIMAL)
 /* trim trailing spaces from a string */
 
 static char* rtrim(char* str)
@@ -308,13 +591,15 @@ static char* rtrim(char* str)
     }
     return str;
 }
+#endif /* !UHUBCTL_MINIMAL */
 
 /*
  * Convert port list into bitmap.
  * Following port list specifications are equivalent:
  *   1,3,4,5,11,12,13
  *   1,3-5,11-13
- * Returns: bitmap of specified ports, max port is MAX_HUB_PORTS.
+ * Returns: bitmap of specified ports, max port is MAX_HUB_PORTS,
+ * or -1 if port specification is not valid.
  */
 
 static int ports2bitmap(char* const portlist)
@@ -349,11 +634,11 @@ static int ports2bitmap(char* const portlist)
         }
         if (a > b) {
             fprintf(stderr, "Bad port spec %d-%d, first port must be less than last\n", a, b);
-            exit(1);
+            return -1;
         }
         if (a <= 0 || a > MAX_HUB_PORTS || b <= 0 || b > MAX_HUB_PORTS) {
             fprintf(stderr, "Bad port spec %d-%d, port numbers must be from 1 to %d\n", a, b, MAX_HUB_PORTS);
-            exit(1);
+            return -1;
         }
         for (i=a; i<=b; i++) {
             ports |= (1 << (i-1));
@@ -362,6 +647,22 @@ static int ports2bitmap(char* const portlist)
     return ports;
 }
 
+/*
+ * Parse action name or number into POWER_* constant.
+ * Returns -2 if action is not recognized.
+ */
+
+static int parse_power_action(const char *arg)
+{
+    if (!strcasecmp(arg, "off")    || !strcasecmp(arg, "0")) return POWER_OFF;
+    if (!strcasecmp(arg, "on")     || !strcasecmp(arg, "1")) return POWER_ON;
+    if (!strcasecmp(arg, "cycle")  || !strcasecmp(arg, "2")) return POWER_CYCLE;
+    if (!strcasecmp(arg, "toggle") || !strcasecmp(arg, "3")) return POWER_TOGGLE;
+    if (!strcasecmp(arg, "flash")  || !strcasecmp(arg, "4")) return POWER_FLASH;
+    if (!strcasecmp(arg, "keep"))                            return POWER_KEEP;
+    return -2;
+}
+
 /*
  * Get model of the computer we are currently running on.
  * On success return 0 and fill model string (null terminated).
@@ -403,6 +704,49 @@ static int check_computer_model(char *target)
 }
 
 
+/*
+ * Convert bus number and port path into USB location string like 1-2.3
+ */
+
+static void format_location(char *buf, int size, uint8_t bus, const uint8_t *pn, int pn_len)
+{
+    int k;
+    snprintf(buf, size, "%d", bus);
+    for (k=0; k < pn_len; k++) {
+        char s[8];
+        snprintf(s, sizeof(s), "%s%d", k==0 ? "-" : ".", pn[k]);
+        strncat(buf, s, size - strlen(buf) - 1);
+    }
+}
+
+
+/*
+ * Parse USB location string like 1-2.3 into bus number and port path.
+ * Returns 0 on success and -1 if string is not a valid full location.
+ */
+
+static int parse_location(const char *location, uint8_t *bus, uint8_t *pn, int *pn_len)
+{
+    int value = atoi(location);
+    if (value <= 0 || value > 255) {
+        return -1;
+    }
+    *bus = value;
+    *pn_len = 0;
+    const char *p = strchr(location, '-');
+    while (p) {
+        p++;
+        value = atoi(p);
+        if (value <= 0 || value > 255 || *pn_len >= MAX_HUB_CHAIN) {
+            return -1;
+        }
+        pn[(*pn_len)++] = value;
+        p = strchr(p, '.');
+    }
+    return 0;
+}
+
+
 /*
  * Compatibility wrapper around libusb_get_port_numbers()
  */
@@ -423,468 +767,2605 @@ static int get_port_numbers(libusb_device *dev, uint8_t *buf, uint8_t bufsize)
 }
 
 /*
- * get USB hub properties.
- * most hub_info fields are filled, except for description.
- * returns 0 for success and error code for failure.
+ * Sanitize a hub_info loaded from disk (topology cache, --bench
+ * recordings): clamp counted fields that are later used as lengths and
+ * force-terminate the strings, so a stale or corrupt file cannot cause
+ * out-of-bounds reads or unterminated %s prints.
  */
 
-static int get_hub_info(struct libusb_device *dev, struct hub_info *info)
+static void sanitize_hub_info(struct hub_info *info)
 {
-    int rc = 0;
-    int len = 0;
-    struct libusb_device_handle *devh = NULL;
-    unsigned char buf[LIBUSB_DT_HUB_NONVAR_SIZE + 2 + 3] = {0};
-    struct usb_hub_descriptor *uhd = (struct usb_hub_descriptor *)buf;
-    int minlen = LIBUSB_DT_HUB_NONVAR_SIZE + 2;
-    struct libusb_device_descriptor desc;
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc)
-        return rc;
-    if (desc.bDeviceClass != LIBUSB_CLASS_HUB)
-        return LIBUSB_ERROR_INVALID_PARAM;
-    int bcd_usb = desc.bcdUSB;
-    int desc_type = bcd_usb >= USB_SS_BCD ? LIBUSB_DT_SUPERSPEED_HUB
-                                          : LIBUSB_DT_HUB;
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        len = libusb_control_transfer(devh,
-            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
-                               | LIBUSB_RECIPIENT_DEVICE, /* hub status */
-            LIBUSB_REQUEST_GET_DESCRIPTOR,
-            desc_type << 8,
-            0,
-            buf, sizeof(buf),
-            USB_CTRL_GET_TIMEOUT
-        );
-
-        if (len >= minlen) {
-            info->dev     = dev;
-            info->bcd_usb = bcd_usb;
-            info->super_speed = (bcd_usb >= USB_SS_BCD);
-            info->nports  = uhd->bNbrPorts;
-            snprintf(
-                info->vendor, sizeof(info->vendor),
-                "%04x:%04x",
-                desc.idVendor,
-                desc.idProduct
-            );
-
-            /* Convert bus and ports array into USB location string */
-            info->bus = libusb_get_bus_number(dev);
-            snprintf(info->location, sizeof(info->location), "%d", info->bus);
-            info->pn_len = get_port_numbers(dev, info->port_numbers, sizeof(info->port_numbers));
-            int k;
-            for (k=0; k < info->pn_len; k++) {
-                char s[8];
-                snprintf(s, sizeof(s), "%s%d", k==0 ? "-" : ".", info->port_numbers[k]);
-                strcat(info->location, s);
-            }
-
-            /* Get container_id: */
-            bzero(info->container_id, sizeof(info->container_id));
-            struct libusb_bos_descriptor *bos;
-            rc = libusb_get_bos_descriptor(devh, &bos);
-            if (rc == 0) {
-                int cap;
-#ifdef __FreeBSD__
-                for (cap=0; cap < bos->bNumDeviceCapabilities; cap++) {
-#else
-                for (cap=0; cap < bos->bNumDeviceCaps; cap++) {
+    if (info->pn_len < 0 || info->pn_len > MAX_HUB_CHAIN) {
+        info->pn_len = 0;
+    }
+    if (info->nports < 0) {
+        info->nports = 0;
+    }
+    if (info->nports > 255) {
+        info->nports = 255; /* bNbrPorts is a single byte */
+    }
+    info->vendor[sizeof(info->vendor)-1] = 0;
+    info->location[sizeof(info->location)-1] = 0;
+#if !defined(UHUBCTL_MINIMAL)
+    info->ds.vendor[sizeof(info->ds.vendor)-1] = 0;
+    info->ds.product[sizeof(info->ds.product)-1] = 0;
+    info->ds.serial[sizeof(info->ds.serial)-1] = 0;
+    info->ds.description[sizeof(info->ds.description)-1] = 0;
 #endif
-                    if (bos->dev_capability[cap]->bDevCapabilityType == LIBUSB_BT_CONTAINER_ID) {
-                        struct libusb_container_id_descriptor *container_id;
-                        rc = libusb_get_container_id_descriptor(NULL, bos->dev_capability[cap], &container_id);
-                        if (rc == 0) {
-                            int i;
-                            for (i=0; i<16; i++) {
-                                sprintf(info->container_id+i*2, "%02x", container_id->ContainerID[i]);
-                            }
-                            info->container_id[i*2] = 0;
-                            libusb_free_container_id_descriptor(container_id);
-                        }
-                    }
-                }
-                libusb_free_bos_descriptor(bos);
+}
 
-                /* Raspberry Pi 4B hack for USB3 root hub: */
-                if (is_rpi_4b &&
-                    strlen(info->container_id)==0 &&
-                    strcasecmp(info->vendor, "1d6b:0003")==0 &&
-                    info->pn_len==0 &&
-                    info->nports==4 &&
-                    bcd_usb==USB_SS_BCD)
-                {
-                    strcpy(info->container_id, "5cf3ee30d5074925b001802d79434c30");
-                }
-            }
 
-            /* Logical Power Switching Mode */
-            int lpsm = uhd->wHubCharacteristics[0] & HUB_CHAR_LPSM;
-            if (lpsm == HUB_CHAR_COMMON_LPSM && info->nports == 1) {
-                /* For 1 port hubs, ganged power switching is the same as per-port: */
-                lpsm = HUB_CHAR_INDV_PORT_LPSM;
-            }
-            /* Raspberry Pi 4B reports inconsistent descriptors, override: */
-            if (is_rpi_4b && lpsm == HUB_CHAR_COMMON_LPSM && strcasecmp(info->vendor, "2109:3431")==0) {
-                lpsm = HUB_CHAR_INDV_PORT_LPSM;
-            }
-            info->lpsm = lpsm;
+/*
+ * Load hub topology cache from opt_cache file.
+ * Missing or invalid cache file is not an error - we simply start cold.
+ */
 
-            /* Raspberry Pi 5 hack */
-            if (is_rpi_5 &&
-                strlen(info->container_id)==0 &&
-                info->lpsm==HUB_CHAR_INDV_PORT_LPSM &&
-                info->pn_len==0)
-            {
-                /* USB2 */
-                if (strcasecmp(info->vendor, "1d6b:0002")==0 &&
-                    info->nports==2 &&
-                    !info->super_speed)
-                {
-                    strcpy(info->container_id, "Raspberry Pi 5 Fake Container Id");
-                }
-                /* USB3 */
-                if (strcasecmp(info->vendor, "1d6b:0003")==0 &&
-                    info->nports==1 &&
-                    info->super_speed)
-                {
-                    strcpy(info->container_id, "Raspberry Pi 5 Fake Container Id");
+static void load_hub_cache(void)
+{
+    struct hub_cache_header hdr;
+    int fd = open(opt_cache, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        hdr.magic == HUB_CACHE_MAGIC &&
+        hdr.version == HUB_CACHE_VERSION &&
+        hdr.entry_size == sizeof(struct hub_cache_entry) &&
+        hdr.count <= MAX_CACHE_ENTRIES)
+    {
+        hub_cache = calloc(hdr.count, sizeof(struct hub_cache_entry));
+        if (hub_cache) {
+            ssize_t want = hdr.count * sizeof(struct hub_cache_entry);
+            if (read(fd, hub_cache, want) == want) {
+                hub_cache_count = hdr.count;
+                int i;
+                for (i=0; i<hub_cache_count; i++) {
+                    sanitize_hub_info(&hub_cache[i].info);
                 }
+            } else {
+                free(hub_cache);
+                hub_cache = NULL;
             }
-            rc = 0;
-        } else {
-            rc = len;
         }
-        libusb_close(devh);
     }
-    return rc;
+    close(fd);
 }
 
 
 /*
- * Assuming that devh is opened device handle for USB hub,
- * return state for given hub port.
- * In case of error, returns -1 (inspect errno for more information).
+ * Write hub topology cache back to opt_cache file if it was modified.
+ * Uses temporary file + rename to stay consistent if interrupted.
  */
 
-static int get_port_status(struct libusb_device_handle *devh, int port)
+static void save_hub_cache(void)
 {
-    int rc;
-    struct usb_port_status ust;
-    if (devh == NULL)
-        return -1;
+    char tmp_path[sizeof(opt_cache) + 8];
+    struct hub_cache_header hdr;
+    if (!hub_cache_dirty || hub_cache_count == 0) {
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", opt_cache);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot write hub cache %s (%s)\n", opt_cache, strerror(errno));
+        return;
+    }
+    hdr.magic = HUB_CACHE_MAGIC;
+    hdr.version = HUB_CACHE_VERSION;
+    hdr.entry_size = sizeof(struct hub_cache_entry);
+    hdr.count = hub_cache_count;
+    ssize_t want = hub_cache_count * sizeof(struct hub_cache_entry);
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        write(fd, hub_cache, want) != want ||
+        rename(tmp_path, opt_cache) != 0)
+    {
+        fprintf(stderr, "Cannot write hub cache %s (%s)\n", opt_cache, strerror(errno));
+        unlink(tmp_path);
+    }
+    close(fd);
+    hub_cache_dirty = 0;
+}
 
-    rc = libusb_control_transfer(devh,
-        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
-                           | LIBUSB_RECIPIENT_OTHER, /* port status */
-        LIBUSB_REQUEST_GET_STATUS, 0,
-        port, (unsigned char*)&ust, sizeof(ust),
-        USB_CTRL_GET_TIMEOUT
-    );
 
-    if (rc < 0) {
-        return rc;
+/*
+ * Look up device in hub topology cache by bus + port path + vid:pid.
+ * Returns cache entry or NULL if not cached.
+ */
+
+static struct hub_cache_entry* hub_cache_find(struct libusb_device *dev,
+    struct libusb_device_descriptor *desc)
+{
+    uint8_t bus = libusb_get_bus_number(dev);
+    uint8_t pn[MAX_HUB_CHAIN];
+    int pn_len = get_port_numbers(dev, pn, sizeof(pn));
+    int i;
+    for (i=0; i<hub_cache_count; i++) {
+        struct hub_cache_entry *entry = &hub_cache[i];
+        if (entry->id_vendor  == desc->idVendor &&
+            entry->id_product == desc->idProduct &&
+            entry->info.bus == bus &&
+            entry->info.pn_len == pn_len &&
+            memcmp(entry->info.port_numbers, pn, pn_len) == 0)
+        {
+            return entry;
+        }
     }
-    return libusb_le16_to_cpu(ust.wPortStatus);
+    return NULL;
 }
 
 
-#if defined(__gnu_linux__) || defined(__linux__)
 /*
- * Try to use the Linux sysfs interface to power a port off/on.
- * Returns 0 on success.
+ * Add hub to topology cache (replacing existing entry for same location).
  */
 
-static int set_port_status_linux(struct libusb_device_handle *devh, struct hub_info *hub, int port, int on)
+static void hub_cache_add(struct libusb_device_descriptor *desc, struct hub_info *info)
 {
-    int configuration = 0;
-    char disable_path[PATH_MAX];
-
-    int rc = libusb_get_configuration(devh, &configuration);
-    if (rc < 0) {
-        return rc;
+    struct hub_cache_entry *entry = hub_cache_find(info->dev, desc);
+    if (entry == NULL) {
+        if (hub_cache_count >= MAX_CACHE_ENTRIES) {
+            return;
+        }
+        entry = realloc(hub_cache, (hub_cache_count + 1) * sizeof(*entry));
+        if (entry == NULL) {
+            return;
+        }
+        hub_cache = entry;
+        entry = &hub_cache[hub_cache_count++];
     }
+    entry->id_vendor  = desc->idVendor;
+    entry->id_product = desc->idProduct;
+    memcpy(&entry->info, info, sizeof(*info));
+    entry->info.dev = NULL;
+    entry->info.actionable = 0;
+    hub_cache_dirty = 1;
+}
 
-    /*
-     * The "disable" sysfs interface is available only starting with kernel version 6.0.
-     * For earlier kernel versions the open() call will fail and we fall back to using libusb.
-     */
-    if (hub->pn_len == 0) {
-      snprintf(disable_path, PATH_MAX,
-          "/sys/bus/usb/devices/%s-0:%d.0/usb%s-port%i/disable",
-          hub->location, configuration, hub->location, port
-      );
-    } else {
-      snprintf(disable_path, PATH_MAX,
-          "/sys/bus/usb/devices/%s:%d.0/%s-port%i/disable",
-          hub->location, configuration, hub->location, port
-      );
-    }
 
-    int disable_fd = open(disable_path, O_WRONLY);
-    if (disable_fd >= 0) {
-        rc = write(disable_fd, on ? "0" : "1", 1);
-        close(disable_fd);
-    }
+#if !defined(UHUBCTL_MINIMAL)
+/*
+ * Negative cache of devices whose string descriptor reads timed out.
+ * One wedged device used to stall every invocation for the full control
+ * timeout per descriptor request - remember such devices (persistently
+ * when -C is used, in file <cache>.neg) and skip their strings, without
+ * resorting to the all-or-nothing --nodesc.
+ */
 
-    if (disable_fd < 0 || rc < 0) {
-        /*
-         * ENOENT is the expected error when running on Linux kernel < 6.0 where
-         * sysfs disable interface does not exist yet - no need to report anything in this case.
-         * If the file exists but another error occurs it is most likely a permission issue.
-         * Print an error message mostly geared towards setting up udev.
-         */
-        if (errno != ENOENT) {
-            fprintf(stderr,
-                "Failed to set port status by writing to %s (%s).\n"
-                "Follow https://git.io/JIB2Z to make sure that udev is set up correctly.\n"
-                "Falling back to libusb based port control.\n"
-                "Use -S to skip trying the sysfs interface and printing this message.\n",
-                disable_path, strerror(errno)
-            );
-        }
+#define NEG_CACHE_MAGIC   0x434e4855 /* "UHNC" */
+#define NEG_CACHE_VERSION 1
+#define MAX_NEG_CACHE_ENTRIES 256
 
-        return -1;
-    }
+struct neg_cache_entry {
+    uint8_t bus;
+    uint8_t pn_len;
+    uint8_t port_numbers[MAX_HUB_CHAIN];
+    uint16_t id_vendor;
+    uint16_t id_product;
+};
 
-    return 0;
-}
+static struct neg_cache_entry *neg_cache = NULL;
+static int neg_cache_count = 0;
+static int neg_cache_dirty = 0;
+#if !defined(_WIN32)
+static pthread_mutex_t neg_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
+static void neg_cache_acquire(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&neg_cache_lock);
+#endif
+}
 
-/*
- * Use a control transfer via libusb to turn a port off/on.
- * Returns >= 0 on success.
- */
+static void neg_cache_release(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&neg_cache_lock);
+#endif
+}
 
-static int set_port_status_libusb(struct libusb_device_handle *devh, int port, int on)
+/* Check if device is known to time out on string descriptor reads: */
+static int neg_cache_find(struct libusb_device *dev, struct libusb_device_descriptor *desc)
 {
-    int rc = 0;
-    int request = on ? LIBUSB_REQUEST_SET_FEATURE
-                     : LIBUSB_REQUEST_CLEAR_FEATURE;
-    int repeat = on ? 1 : opt_repeat;
+    uint8_t bus = libusb_get_bus_number(dev);
+    uint8_t pn[MAX_HUB_CHAIN] = {0};
+    int pn_len = get_port_numbers(dev, pn, sizeof(pn));
+    int i;
+    int found = 0;
+    neg_cache_acquire();
+    for (i=0; i<neg_cache_count; i++) {
+        struct neg_cache_entry *entry = &neg_cache[i];
+        if (entry->id_vendor  == desc->idVendor &&
+            entry->id_product == desc->idProduct &&
+            entry->bus == bus &&
+            entry->pn_len == pn_len &&
+            memcmp(entry->port_numbers, pn, sizeof(pn)) == 0)
+        {
+            found = 1;
+            break;
+        }
+    }
+    neg_cache_release();
+    return found;
+}
 
-    while (repeat-- > 0) {
-        rc = libusb_control_transfer(devh,
-            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
-            request, USB_PORT_FEAT_POWER,
-            port, NULL, 0, USB_CTRL_GET_TIMEOUT
-        );
-        if (rc < 0) {
-            perror("Failed to control port power!\n");
+/* Remember that string descriptor reads of this device time out: */
+static void neg_cache_add(struct libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+    if (neg_cache_find(dev, desc)) {
+        return;
+    }
+    neg_cache_acquire();
+    if (neg_cache_count < MAX_NEG_CACHE_ENTRIES) {
+        struct neg_cache_entry *grown = realloc(neg_cache,
+            (neg_cache_count + 1) * sizeof(*grown));
+        if (grown) {
+            neg_cache = grown;
+            struct neg_cache_entry *entry = &neg_cache[neg_cache_count];
+            bzero(entry, sizeof(*entry));
+            entry->bus = libusb_get_bus_number(dev);
+            int pn_len = get_port_numbers(dev, entry->port_numbers, sizeof(entry->port_numbers));
+            entry->pn_len = pn_len < 0 ? 0 : pn_len;
+            entry->id_vendor  = desc->idVendor;
+            entry->id_product = desc->idProduct;
+            neg_cache_count++;
+            neg_cache_dirty = 1;
         }
-        if (repeat > 0) {
-            sleep_ms(opt_wait);
+    }
+    neg_cache_release();
+}
+
+static void neg_cache_path(char *buf, int size)
+{
+    snprintf(buf, size, "%s.neg", opt_cache);
+}
+
+/* Load persistent negative cache (only used together with -C): */
+static void load_neg_cache(void)
+{
+    char path[sizeof(opt_cache) + 8];
+    struct hub_cache_header hdr;
+    neg_cache_path(path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        hdr.magic == NEG_CACHE_MAGIC &&
+        hdr.version == NEG_CACHE_VERSION &&
+        hdr.entry_size == sizeof(struct neg_cache_entry) &&
+        hdr.count <= MAX_NEG_CACHE_ENTRIES)
+    {
+        neg_cache = calloc(hdr.count ? hdr.count : 1, sizeof(struct neg_cache_entry));
+        if (neg_cache) {
+            ssize_t want = hdr.count * sizeof(struct neg_cache_entry);
+            if (read(fd, neg_cache, want) == want) {
+                neg_cache_count = hdr.count;
+            } else {
+                free(neg_cache);
+                neg_cache = NULL;
+            }
         }
     }
+    close(fd);
+}
 
-    return rc;
+/* Persist negative cache if new unresponsive devices were found: */
+static void save_neg_cache(void)
+{
+    char path[sizeof(opt_cache) + 8];
+    char tmp_path[sizeof(path) + 8];
+    struct hub_cache_header hdr;
+    if (!neg_cache_dirty || neg_cache_count == 0) {
+        return;
+    }
+    neg_cache_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot write negative cache %s (%s)\n", path, strerror(errno));
+        return;
+    }
+    hdr.magic = NEG_CACHE_MAGIC;
+    hdr.version = NEG_CACHE_VERSION;
+    hdr.entry_size = sizeof(struct neg_cache_entry);
+    hdr.count = neg_cache_count;
+    ssize_t want = neg_cache_count * sizeof(struct neg_cache_entry);
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        write(fd, neg_cache, want) != want ||
+        rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Cannot write negative cache %s (%s)\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    close(fd);
+    neg_cache_dirty = 0;
 }
+#endif /* !UHUBCTL_MINIMAL */
 
 
 /*
- * Try different methods to power a port off/on.
- * Return >= 0 on success.
+ * Per-model settle time learning store.
+ * Hardcoded settle delays are one-size-fits-all, but real hubs range
+ * from tens to hundreds of ms to actually drop port power. Whenever
+ * verification-driven cycling observes how long a hub model (keyed by
+ * vid:pid) really took, remember the worst case seen and use it to
+ * seed settle waits on later runs - persistently in file <cache>.settle
+ * when -C is used. Measured per-model numbers then replace the
+ * conservative defaults fleet-wide.
  */
 
-static int set_port_status(struct libusb_device_handle *devh, struct hub_info *hub, int port, int on)
-{
-#if defined(__gnu_linux__) || defined(__linux__)
-    if (!opt_nosysfs) {
-        if (set_port_status_linux(devh, hub, port, on) == 0) {
-            return 0;
-        }
-    }
-#else
-    (void)hub;
+#define SETTLE_CACHE_MAGIC   0x54534855 /* "UHST" */
+#define SETTLE_CACHE_VERSION 1
+#define MAX_SETTLE_ENTRIES   256
+#define SETTLE_MAX_MS        2000 /* distrust measurements above this */
+
+struct settle_entry {
+    char vendor[16];  /* vid:pid, as in hub_info.vendor */
+    int32_t off_ms;   /* longest observed time for ports to drop power */
+    int32_t samples;
+};
+
+static struct settle_entry *settle_cache = NULL;
+static int settle_cache_count = 0;
+static int settle_cache_dirty = 0;
+#if !defined(_WIN32)
+static pthread_mutex_t settle_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-    return set_port_status_libusb(devh, port, on);
+static void settle_cache_acquire(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&settle_cache_lock);
+#endif
 }
 
+static void settle_cache_release(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&settle_cache_lock);
+#endif
+}
 
-/*
- * Get USB device descriptor strings and summary description.
- *
- * Summary will use following format:
- *
- *    "<vid:pid> <vendor> <product> <serial>, <USB x.yz, N ports>"
- *
- * vid:pid will be always present, but vendor, product or serial
- * may be skipped if they are empty or not enough permissions to read them.
- * <USB x.yz, N ports> will be present only for USB hubs.
- *
- * Returns 0 for success and error code for failure.
- * In case of failure return buffer is not altered.
- */
+/* Learned power-off settle time of this hub model in ms, 0 if unknown: */
+static int settle_find(struct hub_info *hub)
+{
+    int i;
+    int ms = 0;
+    settle_cache_acquire();
+    for (i=0; i<settle_cache_count; i++) {
+        if (strncmp(settle_cache[i].vendor, hub->vendor, sizeof(hub->vendor)) == 0) {
+            ms = settle_cache[i].off_ms;
+            break;
+        }
+    }
+    settle_cache_release();
+    return ms;
+}
 
-static int get_device_description(struct libusb_device * dev, struct descriptor_strings * ds)
+/* Record one verified power-off settle measurement for this hub model: */
+static void settle_learn(struct hub_info *hub, int off_ms)
 {
-    int rc;
-    int id_vendor  = 0;
-    int id_product = 0;
-    char hub_specific[64] = "";
-    struct libusb_device_descriptor desc;
-    struct libusb_device_handle *devh = NULL;
-    rc = libusb_get_device_descriptor(dev, &desc);
-    if (rc)
-        return rc;
-    bzero(ds, sizeof(*ds));
-    id_vendor  = desc.idVendor;
-    id_product = desc.idProduct;
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        if (!opt_nodesc) {
-            if (desc.iManufacturer) {
-                rc = libusb_get_string_descriptor_ascii(devh,
-                    desc.iManufacturer, (unsigned char*)ds->vendor, sizeof(ds->vendor));
-                rtrim(ds->vendor);
-            }
-            if (rc >= 0 && desc.iProduct) {
-                rc = libusb_get_string_descriptor_ascii(devh,
-                    desc.iProduct, (unsigned char*)ds->product, sizeof(ds->product));
-                rtrim(ds->product);
-            }
-            if (rc >= 0 && desc.iSerialNumber) {
-                rc = libusb_get_string_descriptor_ascii(devh,
-                    desc.iSerialNumber, (unsigned char*)ds->serial, sizeof(ds->serial));
-                rtrim(ds->serial);
+    int i;
+    if (off_ms < 0 || off_ms > SETTLE_MAX_MS || strlen(hub->vendor) == 0) {
+        return;
+    }
+    settle_cache_acquire();
+    for (i=0; i<settle_cache_count; i++) {
+        if (strncmp(settle_cache[i].vendor, hub->vendor, sizeof(hub->vendor)) == 0) {
+            if (off_ms > settle_cache[i].off_ms) {
+                settle_cache[i].off_ms = off_ms;
+                settle_cache_dirty = 1;
             }
+            settle_cache[i].samples++;
+            settle_cache_release();
+            return;
         }
-        if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
-            struct hub_info info;
-            bzero(&info, sizeof(info));
-            rc = get_hub_info(dev, &info);
-            if (rc == 0) {
-                const char * lpsm_type;
-                if (info.lpsm == HUB_CHAR_INDV_PORT_LPSM) {
-                    lpsm_type = "ppps";
-                } else if (info.lpsm == HUB_CHAR_COMMON_LPSM) {
-                    lpsm_type = "ganged";
-                } else {
-                    lpsm_type = "nops";
-                }
-                snprintf(hub_specific, sizeof(hub_specific), ", USB %x.%02x, %d ports, %s",
-                   info.bcd_usb >> 8, info.bcd_usb & 0xFF, info.nports, lpsm_type);
-            }
+    }
+    if (settle_cache_count < MAX_SETTLE_ENTRIES) {
+        struct settle_entry *grown = realloc(settle_cache,
+            (settle_cache_count + 1) * sizeof(*grown));
+        if (grown) {
+            settle_cache = grown;
+            struct settle_entry *entry = &settle_cache[settle_cache_count];
+            bzero(entry, sizeof(*entry));
+            snprintf(entry->vendor, sizeof(entry->vendor), "%s", hub->vendor);
+            entry->off_ms = off_ms;
+            entry->samples = 1;
+            settle_cache_count++;
+            settle_cache_dirty = 1;
         }
-        libusb_close(devh);
     }
-    snprintf(ds->description, sizeof(ds->description),
-        "%04x:%04x%s%s%s%s%s%s%s",
-        id_vendor, id_product,
-        ds->vendor[0]  ? " " : "", ds->vendor,
-        ds->product[0] ? " " : "", ds->product,
-        ds->serial[0]  ? " " : "", ds->serial,
-        hub_specific
-    );
-    return 0;
+    settle_cache_release();
 }
 
-
-/*
- * show status for hub ports
- * portmask is bitmap of ports to display
- * if portmask is 0, show all ports
- */
-
-static int print_port_status(struct hub_info * hub, int portmask)
+/* Settle delay to use for this hub: learned value if known (clamped to
+ * a sane range), otherwise the conservative built-in fallback: */
+static int settle_seed_ms(struct hub_info *hub, int fallback_ms)
 {
-    int port_status;
-    struct libusb_device_handle * devh = NULL;
-    int rc = 0;
-    struct libusb_device *dev = hub->dev;
-    rc = libusb_open(dev, &devh);
-    if (rc == 0) {
-        int port;
-        for (port = 1; port <= hub->nports; port++) {
-            if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
-
-            port_status = get_port_status(devh, port);
-            if (port_status == -1) {
-                fprintf(stderr,
-                    "cannot read port %d status, %s (%d)\n",
-                    port, strerror(errno), errno);
-                break;
-            }
-
-            printf("  Port %d: %04x", port, port_status);
+    int ms = settle_find(hub);
+    if (ms <= 0) {
+        return fallback_ms;
+    }
+    if (ms < POWER_POLL_INTERVAL_MS) {
+        ms = POWER_POLL_INTERVAL_MS;
+    }
+    return ms;
+}
 
-            struct descriptor_strings ds;
-            bzero(&ds, sizeof(ds));
-            struct libusb_device * udev;
-            int i = 0;
-            while ((udev = usb_devs[i++]) != NULL) {
-                uint8_t dev_bus;
-                uint8_t dev_pn[MAX_HUB_CHAIN];
-                int dev_plen;
-                dev_bus = libusb_get_bus_number(udev);
-                /* only match devices on the same bus: */
-                if (dev_bus != hub->bus) continue;
-                dev_plen = get_port_numbers(udev, dev_pn, sizeof(dev_pn));
-                if ((dev_plen == hub->pn_len + 1) &&
-                    (memcmp(hub->port_numbers, dev_pn, hub->pn_len) == 0) &&
-                    libusb_get_port_number(udev) == port)
-                {
-                    rc = get_device_description(udev, &ds);
-                    if (rc == 0)
-                        break;
-                }
-            }
+static void settle_cache_path(char *buf, int size)
+{
+    snprintf(buf, size, "%s.settle", opt_cache);
+}
 
-            if (!hub->super_speed) {
-                if (port_status == 0) {
-                    printf(" off");
-                } else {
-                    if (port_status & USB_PORT_STAT_POWER)        printf(" power");
-                    if (port_status & USB_PORT_STAT_INDICATOR)    printf(" indicator");
-                    if (port_status & USB_PORT_STAT_TEST)         printf(" test");
-                    if (port_status & USB_PORT_STAT_HIGH_SPEED)   printf(" highspeed");
-                    if (port_status & USB_PORT_STAT_LOW_SPEED)    printf(" lowspeed");
-                    if (port_status & USB_PORT_STAT_SUSPEND)      printf(" suspend");
-                }
+/* Load persistent settle time store (only used together with -C): */
+static void load_settle_cache(void)
+{
+    char path[sizeof(opt_cache) + 8];
+    struct hub_cache_header hdr;
+    settle_cache_path(path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        hdr.magic == SETTLE_CACHE_MAGIC &&
+        hdr.version == SETTLE_CACHE_VERSION &&
+        hdr.entry_size == sizeof(struct settle_entry) &&
+        hdr.count <= MAX_SETTLE_ENTRIES)
+    {
+        settle_cache = calloc(hdr.count ? hdr.count : 1, sizeof(struct settle_entry));
+        if (settle_cache) {
+            ssize_t want = hdr.count * sizeof(struct settle_entry);
+            if (read(fd, settle_cache, want) == want) {
+                settle_cache_count = hdr.count;
             } else {
-                if (!(port_status & USB_SS_PORT_STAT_POWER)) {
-                    printf(" off");
-                } else {
-                    int link_state = port_status & USB_PORT_STAT_LINK_STATE;
-                    if (port_status & USB_SS_PORT_STAT_POWER)     printf(" power");
-                    if ((port_status & USB_SS_PORT_STAT_SPEED)
-                         == USB_PORT_STAT_SPEED_5GBPS)
-                    {
-                        printf(" 5gbps");
-                    }
-                    if (link_state == USB_SS_PORT_LS_U0)          printf(" U0");
-                    if (link_state == USB_SS_PORT_LS_U1)          printf(" U1");
-                    if (link_state == USB_SS_PORT_LS_U2)          printf(" U2");
-                    if (link_state == USB_SS_PORT_LS_U3)          printf(" U3");
-                    if (link_state == USB_SS_PORT_LS_SS_DISABLED) printf(" SS.Disabled");
-                    if (link_state == USB_SS_PORT_LS_RX_DETECT)   printf(" Rx.Detect");
-                    if (link_state == USB_SS_PORT_LS_SS_INACTIVE) printf(" SS.Inactive");
-                    if (link_state == USB_SS_PORT_LS_POLLING)     printf(" Polling");
-                    if (link_state == USB_SS_PORT_LS_RECOVERY)    printf(" Recovery");
-                    if (link_state == USB_SS_PORT_LS_HOT_RESET)   printf(" HotReset");
-                    if (link_state == USB_SS_PORT_LS_COMP_MOD)    printf(" Compliance");
-                    if (link_state == USB_SS_PORT_LS_LOOPBACK)    printf(" Loopback");
-                }
+                free(settle_cache);
+                settle_cache = NULL;
             }
-            if (port_status & USB_PORT_STAT_RESET)       printf(" reset");
-            if (port_status & USB_PORT_STAT_OVERCURRENT) printf(" oc");
-            if (port_status & USB_PORT_STAT_ENABLE)      printf(" enable");
-            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" connect");
-
-            if (port_status & USB_PORT_STAT_CONNECTION)  printf(" [%s]", ds.description);
-
-            printf("\n");
         }
-        libusb_close(devh);
     }
-    return 0;
+    close(fd);
+}
+
+/* Persist settle time store if new measurements were learned: */
+static void save_settle_cache(void)
+{
+    char path[sizeof(opt_cache) + 8];
+    char tmp_path[sizeof(path) + 8];
+    struct hub_cache_header hdr;
+    if (!settle_cache_dirty || settle_cache_count == 0) {
+        return;
+    }
+    settle_cache_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot write settle cache %s (%s)\n", path, strerror(errno));
+        return;
+    }
+    hdr.magic = SETTLE_CACHE_MAGIC;
+    hdr.version = SETTLE_CACHE_VERSION;
+    hdr.entry_size = sizeof(struct settle_entry);
+    hdr.count = settle_cache_count;
+    ssize_t want = settle_cache_count * sizeof(struct settle_entry);
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        write(fd, settle_cache, want) != want ||
+        rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Cannot write settle cache %s (%s)\n", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    close(fd);
+    settle_cache_dirty = 0;
 }
 
 
 /*
- *  Find all USB hubs and fill hubs[] array.
+ * get USB hub properties.
+ * most hub_info fields are filled, except for description.
+ * returns 0 for success and error code for failure.
+ */
+
+static int get_hub_info(struct libusb_device *dev, struct hub_info *info)
+{
+    int rc = 0;
+    int len = 0;
+    struct libusb_device_handle *devh = NULL;
+    unsigned char buf[LIBUSB_DT_HUB_NONVAR_SIZE + 2 + 3] = {0};
+    struct usb_hub_descriptor *uhd = (struct usb_hub_descriptor *)buf;
+    int minlen = LIBUSB_DT_HUB_NONVAR_SIZE + 2;
+    struct libusb_device_descriptor desc;
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc)
+        return rc;
+    if (desc.bDeviceClass != LIBUSB_CLASS_HUB)
+        return LIBUSB_ERROR_INVALID_PARAM;
+    int bcd_usb = desc.bcdUSB;
+    int desc_type = bcd_usb >= USB_SS_BCD ? LIBUSB_DT_SUPERSPEED_HUB
+                                          : LIBUSB_DT_HUB;
+    rc = libusb_open(dev, &devh);
+    if (rc == 0) {
+        len = libusb_control_transfer(devh,
+            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                               | LIBUSB_RECIPIENT_DEVICE, /* hub status */
+            LIBUSB_REQUEST_GET_DESCRIPTOR,
+            desc_type << 8,
+            0,
+            buf, sizeof(buf),
+            scan_timeout_ms()
+        );
+
+        if (len >= minlen) {
+            info->dev     = dev;
+            info->bcd_usb = bcd_usb;
+            info->super_speed = (bcd_usb >= USB_SS_BCD);
+            info->nports  = uhd->bNbrPorts;
+            snprintf(
+                info->vendor, sizeof(info->vendor),
+                "%04x:%04x",
+                desc.idVendor,
+                desc.idProduct
+            );
+
+            /* Convert bus and ports array into USB location string */
+            info->bus = libusb_get_bus_number(dev);
+            info->pn_len = get_port_numbers(dev, info->port_numbers, sizeof(info->port_numbers));
+            format_location(info->location, sizeof(info->location),
+                info->bus, info->port_numbers, info->pn_len);
+
+#if !defined(UHUBCTL_MINIMAL)
+            /* Get container_id: */
+            bzero(info->container_id, sizeof(info->container_id));
+            info->has_container_id = 0;
+            struct libusb_bos_descriptor *bos;
+            rc = libusb_get_bos_descriptor(devh, &bos);
+            if (rc == 0) {
+                int cap;
+#ifdef __FreeBSD__
+                for (cap=0; cap < bos->bNumDeviceCapabilities; cap++) {
+#else
+                for (cap=0; cap < bos->bNumDeviceCaps; cap++) {
+#endif
+                    if (bos->dev_capability[cap]->bDevCapabilityType == LIBUSB_BT_CONTAINER_ID) {
+                        struct libusb_container_id_descriptor *container_id;
+                        rc = libusb_get_container_id_descriptor(NULL, bos->dev_capability[cap], &container_id);
+                        if (rc == 0) {
+                            memcpy(info->container_id, container_id->ContainerID,
+                                sizeof(info->container_id));
+                            info->has_container_id = 1;
+                            libusb_free_container_id_descriptor(container_id);
+                        }
+                    }
+                }
+                libusb_free_bos_descriptor(bos);
+
+                /* Raspberry Pi 4B hack for USB3 root hub: */
+                if (is_rpi_4b &&
+                    !info->has_container_id &&
+                    strcasecmp(info->vendor, "1d6b:0003")==0 &&
+                    info->pn_len==0 &&
+                    info->nports==4 &&
+                    bcd_usb==USB_SS_BCD)
+                {
+                    static const uint8_t rpi_4b_cid[16] = {
+                        0x5c, 0xf3, 0xee, 0x30, 0xd5, 0x07, 0x49, 0x25,
+                        0xb0, 0x01, 0x80, 0x2d, 0x79, 0x43, 0x4c, 0x30,
+                    };
+                    memcpy(info->container_id, rpi_4b_cid, sizeof(info->container_id));
+                    info->has_container_id = 1;
+                }
+            }
+#endif
+
+            /* Logical Power Switching Mode */
+            int lpsm = uhd->wHubCharacteristics[0] & HUB_CHAR_LPSM;
+            if (lpsm == HUB_CHAR_COMMON_LPSM && info->nports == 1) {
+                /* For 1 port hubs, ganged power switching is the same as per-port: */
+                lpsm = HUB_CHAR_INDV_PORT_LPSM;
+            }
+            /* Raspberry Pi 4B reports inconsistent descriptors, override: */
+            if (is_rpi_4b && lpsm == HUB_CHAR_COMMON_LPSM && strcasecmp(info->vendor, "2109:3431")==0) {
+                lpsm = HUB_CHAR_INDV_PORT_LPSM;
+            }
+            info->lpsm = lpsm;
+
+#if !defined(UHUBCTL_MINIMAL)
+            /* Raspberry Pi 5 hack */
+            if (is_rpi_5 &&
+                !info->has_container_id &&
+                info->lpsm==HUB_CHAR_INDV_PORT_LPSM &&
+                info->pn_len==0)
+            {
+                /* USB2 */
+                if (strcasecmp(info->vendor, "1d6b:0002")==0 &&
+                    info->nports==2 &&
+                    !info->super_speed)
+                {
+                    memcpy(info->container_id, "Raspberry Pi 5 Fake", sizeof(info->container_id));
+                    info->has_container_id = 1;
+                }
+                /* USB3 */
+                if (strcasecmp(info->vendor, "1d6b:0003")==0 &&
+                    info->nports==1 &&
+                    info->super_speed)
+                {
+                    memcpy(info->container_id, "Raspberry Pi 5 Fake", sizeof(info->container_id));
+                    info->has_container_id = 1;
+                }
+            }
+#endif
+            rc = 0;
+        } else {
+            rc = len;
+        }
+        libusb_close(devh);
+    }
+    return rc;
+}
+
+
+/*
+ * Assuming that devh is opened device handle for USB hub,
+ * return state for given hub port.
+ * In case of error, returns -1 (inspect errno for more information).
+ */
+
+static int get_port_status(struct libusb_device_handle *devh, int port)
+{
+    int rc;
+    struct usb_port_status ust;
+    if (devh == NULL)
+        return -1;
+
+    int64_t pt = prof_start();
+    rc = libusb_control_transfer(devh,
+        LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS
+                           | LIBUSB_RECIPIENT_OTHER, /* port status */
+        LIBUSB_REQUEST_GET_STATUS, 0,
+        port, (unsigned char*)&ust, sizeof(ust),
+        USB_CTRL_GET_TIMEOUT
+    );
+    prof_end(PROF_PORT_STATUS, pt);
+
+    if (rc < 0) {
+        return rc;
+    }
+    return libusb_le16_to_cpu(ust.wPortStatus);
+}
+
+
+#if defined(__gnu_linux__) || defined(__linux__)
+/*
+ * Per-hub cache for the sysfs port interfaces: the hub configuration
+ * is resolved once per hub and attribute file descriptors stay open
+ * across operations, so repeated port flips and status reads (flash,
+ * repeat, daemon mode) are a single 1-byte pwrite()/pread() on the
+ * hot path.
+ */
+
+struct sysfs_hub_cache {
+    struct hub_info *hub;
+    int configuration;        /* hub configuration, resolved once; -1 = unknown */
+    int fd[MAX_HUB_PORTS+1];  /* disable fds; 0 = not opened yet, -1 = unavailable */
+    int state_fd[MAX_HUB_PORTS+1]; /* state fds, same convention */
+};
+
+/* Max hubs tracked by the fd cache; hubs beyond this just fall back: */
+#define SYSFS_CACHE_SIZE 128
+
+static struct sysfs_hub_cache sysfs_cache[SYSFS_CACHE_SIZE];
+static int sysfs_cache_count = 0;
+static pthread_mutex_t sysfs_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sysfs_hub_cache* sysfs_cache_get(struct hub_info *hub)
+{
+    int i;
+    struct sysfs_hub_cache *entry = NULL;
+    pthread_mutex_lock(&sysfs_cache_lock);
+    for (i=0; i<sysfs_cache_count; i++) {
+        if (sysfs_cache[i].hub == hub) {
+            entry = &sysfs_cache[i];
+            break;
+        }
+    }
+    if (entry == NULL && sysfs_cache_count < SYSFS_CACHE_SIZE) {
+        entry = &sysfs_cache[sysfs_cache_count++];
+        bzero(entry, sizeof(*entry));
+        entry->hub = hub;
+        entry->configuration = -1;
+    }
+    pthread_mutex_unlock(&sysfs_cache_lock);
+    return entry;
+}
+
+/* Drop cached sysfs state (hub pointers die when hubs[] is rebuilt): */
+static void sysfs_cache_clear(void)
+{
+    int i, port;
+    pthread_mutex_lock(&sysfs_cache_lock);
+    for (i=0; i<sysfs_cache_count; i++) {
+        for (port=0; port<=MAX_HUB_PORTS; port++) {
+            if (sysfs_cache[i].fd[port] > 0) {
+                close(sysfs_cache[i].fd[port]);
+            }
+            if (sysfs_cache[i].state_fd[port] > 0) {
+                close(sysfs_cache[i].state_fd[port]);
+            }
+        }
+    }
+    sysfs_cache_count = 0;
+    pthread_mutex_unlock(&sysfs_cache_lock);
+}
+
+/* Build the sysfs path of one hub port attribute: */
+static void sysfs_port_path(char *buf, int size, struct hub_info *hub,
+    int configuration, int port, const char *attr)
+{
+    if (hub->pn_len == 0) {
+        snprintf(buf, size,
+            "/sys/bus/usb/devices/%s-0:%d.0/usb%s-port%i/%s",
+            hub->location, configuration, hub->location, port, attr
+        );
+    } else {
+        snprintf(buf, size,
+            "/sys/bus/usb/devices/%s:%d.0/%s-port%i/%s",
+            hub->location, configuration, hub->location, port, attr
+        );
+    }
+}
+
+/*
+ * Read status of requested ports from sysfs, with no USB control
+ * traffic (sibling of set_port_status_linux(), same path layout).
+ * The per-port `state` attribute is served straight from kernel
+ * memory; when it shows an attached device the port is necessarily
+ * powered, and the child device's `speed` attribute recovers the
+ * speed bits. An empty port reads "not-attached" whether it has power
+ * or not - telling those apart needs a real GET_STATUS - so such
+ * ports are left unresolved (-1) for the libusb path to pick up.
+ * Bits sysfs cannot see (overcurrent, reset) read as zero.
+ */
+
+static void get_ports_status_sysfs(struct libusb_device_handle *devh,
+    struct hub_info *hub, int portmask, int *status)
+{
+    struct sysfs_hub_cache *cache = sysfs_cache_get(hub);
+    char buf[32];
+    char path[PATH_MAX];
+    int port;
+    if (cache == NULL) {
+        return;
+    }
+    for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+        int fd = cache->state_fd[port];
+        if (fd < 0) {
+            continue; /* known to be unavailable, don't retry the open() */
+        }
+        if (fd == 0) {
+            int configuration = cache->configuration;
+            if (configuration < 0) {
+                if (libusb_get_configuration(devh, &configuration) < 0) {
+                    return;
+                }
+                cache->configuration = configuration;
+            }
+            sysfs_port_path(path, sizeof(path), hub, configuration, port, "state");
+            fd = open(path, O_RDONLY);
+            cache->state_fd[port] = fd < 0 ? -1 : fd;
+            if (fd < 0) {
+                continue;
+            }
+        }
+        ssize_t n = pread(fd, buf, sizeof(buf)-1, 0);
+        if (n <= 0) {
+            continue;
+        }
+        buf[n] = 0;
+        /* The kernel's usb_state_string() spells it "not attached",
+         * while the sysfs ABI doc hyphenates - accept both: */
+        if (strncmp(buf, "not attached", 12) == 0 ||
+            strncmp(buf, "not-attached", 12) == 0)
+        {
+            continue; /* powered-and-empty or off - cannot tell from here */
+        }
+        int st = USB_PORT_STAT_CONNECTION;
+        st |= hub->super_speed ? USB_SS_PORT_STAT_POWER : USB_PORT_STAT_POWER;
+        if (strncmp(buf, "configured", 10) == 0 ||
+            strncmp(buf, "addressed", 9) == 0)
+        {
+            st |= USB_PORT_STAT_ENABLE;
+        }
+        if (strncmp(buf, "suspended", 9) == 0) {
+            st |= USB_PORT_STAT_ENABLE;
+            if (hub->super_speed) {
+                st |= USB_SS_PORT_LS_U3;
+            } else {
+                st |= USB_PORT_STAT_SUSPEND;
+            }
+        }
+        /* Child device speed recovers the speed bits of the status: */
+        if (hub->pn_len == 0) {
+            snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s-%d/speed",
+                hub->location, port);
+        } else {
+            snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s.%d/speed",
+                hub->location, port);
+        }
+        int speed_fd = open(path, O_RDONLY);
+        if (speed_fd >= 0) {
+            n = pread(speed_fd, buf, sizeof(buf)-1, 0);
+            close(speed_fd);
+            if (n > 0) {
+                buf[n] = 0;
+                int mbps = atoi(buf);
+                if (hub->super_speed) {
+                    if (mbps > 5000) {
+                        st |= USB_PORT_STAT_SPEED_10GBPS;
+                    }
+                } else if (mbps > 0 && mbps < 12) {
+                    st |= USB_PORT_STAT_LOW_SPEED;
+                } else if (mbps >= 480) {
+                    st |= USB_PORT_STAT_HIGH_SPEED;
+                }
+            }
+        }
+        status[port] = st;
+    }
+}
+#endif
+
+
+/*
+ * Port state history (watch and daemon modes): a fixed-size ring of
+ * timestamped wPortStatus transitions, fed from every status read the
+ * tool performs anyway - no extra USB polling. Per-port counters track
+ * connect/disconnect flaps and overcurrent events, for diagnosing
+ * flapping devices without diffing repeated invocations. Dumped on
+ * demand: SIGUSR1 in watch mode, `history` command in daemon mode.
+ */
+
+#define HISTORY_RING_SIZE 1024
+#define HISTORY_MAX_PORTS 256
+
+struct port_hist_event {
+    int64_t when_ms;   /* monotonic clock, as get_time_ms() */
+    uint16_t status;   /* new wPortStatus */
+    uint16_t prev;     /* previous wPortStatus */
+    uint8_t port;
+    char location[32];
+};
+
+struct port_hist_track {
+    char location[32];
+    uint8_t port;
+    int last_status;   /* -1 = not seen yet */
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t overcurrents;
+};
+
+static struct port_hist_event *hist_ring = NULL;
+static int hist_head = 0;   /* next ring write position */
+static int hist_total = 0;  /* events recorded overall, may exceed ring size */
+static struct port_hist_track *hist_track = NULL;
+static int hist_track_count = 0;
+#if !defined(_WIN32)
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void hist_acquire(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&hist_lock);
+#endif
+}
+
+static void hist_release(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&hist_lock);
+#endif
+}
+
+/* Preallocate the ring; history stays disabled (and free) until this runs: */
+static void history_enable(void)
+{
+    if (hist_ring == NULL) {
+        hist_ring = calloc(HISTORY_RING_SIZE, sizeof(*hist_ring));
+        hist_track = calloc(HISTORY_MAX_PORTS, sizeof(*hist_track));
+    }
+}
+
+#if !defined(_WIN32)
+/* SIGUSR1 requests a history dump; performed outside the handler: */
+static volatile sig_atomic_t hist_dump_requested = 0;
+
+static void history_signal(int sig)
+{
+    (void)sig;
+    hist_dump_requested = 1;
+}
+#endif
+
+/* Feed one observed port status into the history, recording a
+ * transition if it differs from the last known state of that port: */
+static void history_note(struct hub_info *hub, int port, int status)
+{
+    int i;
+    if (hist_ring == NULL || hist_track == NULL || status < 0) {
+        return;
+    }
+    hist_acquire();
+    struct port_hist_track *track = NULL;
+    for (i=0; i<hist_track_count; i++) {
+        if (hist_track[i].port == port &&
+            strcmp(hist_track[i].location, hub->location) == 0)
+        {
+            track = &hist_track[i];
+            break;
+        }
+    }
+    if (track == NULL) {
+        if (hist_track_count >= HISTORY_MAX_PORTS) {
+            hist_release();
+            return;
+        }
+        track = &hist_track[hist_track_count++];
+        snprintf(track->location, sizeof(track->location), "%s", hub->location);
+        track->port = port;
+        track->last_status = -1;
+    }
+    if (track->last_status >= 0 && track->last_status != status) {
+        struct port_hist_event *ev = &hist_ring[hist_head];
+        hist_head = (hist_head + 1) % HISTORY_RING_SIZE;
+        hist_total++;
+        ev->when_ms = get_time_ms();
+        ev->status = status;
+        ev->prev = track->last_status;
+        ev->port = port;
+        snprintf(ev->location, sizeof(ev->location), "%s", hub->location);
+        if ((track->last_status ^ status) & USB_PORT_STAT_CONNECTION) {
+            if (status & USB_PORT_STAT_CONNECTION) {
+                track->connects++;
+            } else {
+                track->disconnects++;
+            }
+        }
+        if ((status & USB_PORT_STAT_OVERCURRENT) &&
+            !(track->last_status & USB_PORT_STAT_OVERCURRENT))
+        {
+            track->overcurrents++;
+        }
+    }
+    track->last_status = status;
+    hist_release();
+}
+
+/* Print recorded transitions (oldest first) and per-port counters: */
+static void history_dump(void)
+{
+    int i;
+    if (hist_ring == NULL || hist_track == NULL) {
+        return;
+    }
+    hist_acquire();
+    int n = hist_total < HISTORY_RING_SIZE ? hist_total : HISTORY_RING_SIZE;
+    printf("Port status history: %d transition(s)%s\n",
+        hist_total, hist_total > n ? " (oldest dropped)" : "");
+    int start = (hist_head - n + HISTORY_RING_SIZE) % HISTORY_RING_SIZE;
+    for (i=0; i<n; i++) {
+        struct port_hist_event *ev = &hist_ring[(start + i) % HISTORY_RING_SIZE];
+        printf("  %lld.%03llds %s port %d: %04x -> %04x\n",
+            (long long)(ev->when_ms / 1000), (long long)(ev->when_ms % 1000),
+            ev->location, ev->port, ev->prev, ev->status);
+    }
+    for (i=0; i<hist_track_count; i++) {
+        struct port_hist_track *track = &hist_track[i];
+        if (track->connects + track->disconnects + track->overcurrents == 0) {
+            continue;
+        }
+        printf("  %s port %d: %u connect(s), %u disconnect(s), %u overcurrent(s)\n",
+            track->location, track->port,
+            track->connects, track->disconnects, track->overcurrents);
+    }
+    hist_release();
+    fflush(stdout);
+}
+
+
+/*
+ * Bookkeeping for one batch of asynchronous transfers. Several threads
+ * pump the single libusb context at once (-m, batch mode), so a
+ * callback may run on any of them: the outstanding count is guarded by
+ * a lock, and the completed flag - the one handed to
+ * libusb_handle_events_completed() - is raised when the count reaches
+ * zero, so a completion reaped by another thread cannot strand the
+ * submitter inside the event loop.
+ * The submitter holds one reference of its own while it is still
+ * submitting, so the flag cannot be raised with submissions in flight.
+ */
+
+struct xfer_batch {
+    int pending;    /* outstanding transfers plus the submitter's reference */
+    int completed;  /* raised when pending reaches zero */
+};
+
+#if !defined(_WIN32)
+static pthread_mutex_t xfer_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void xfer_acquire(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&xfer_lock);
+#endif
+}
+
+static void xfer_release(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&xfer_lock);
+#endif
+}
+
+/* Take one reference. Must precede libusb_submit_transfer(), since the
+ * callback can fire on another thread the moment submission succeeds: */
+static void xfer_batch_ref(struct xfer_batch *batch)
+{
+    xfer_acquire();
+    batch->pending++;
+    xfer_release();
+}
+
+/* Drop one reference (transfer finished, submission failed, or the
+ * submitter is done submitting), raising completed on the last one: */
+static void xfer_batch_done(struct xfer_batch *batch)
+{
+    xfer_acquire();
+    if (--batch->pending == 0) {
+        batch->completed = 1;
+    }
+    xfer_release();
+}
+
+static int xfer_batch_completed(struct xfer_batch *batch)
+{
+    xfer_acquire();
+    int completed = batch->completed;
+    xfer_release();
+    return completed;
+}
+
+/* Give up on a batch after this many real event loop failures, so a
+ * persistently broken context cannot spin the drain loop forever: */
+#define XFER_MAX_EVENT_FAILURES 10
+
+
+/* Context for one asynchronous port status read: */
+struct port_status_request {
+    unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + sizeof(struct usb_port_status)];
+    struct libusb_transfer *transfer;
+    int *status;    /* where to store wPortStatus */
+    int done;       /* callback ran, libusb no longer owns the transfer */
+    struct xfer_batch *batch;
+};
+
+static void port_status_completed(struct libusb_transfer *transfer)
+{
+    struct port_status_request *req = transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        transfer->actual_length >= (int)sizeof(struct usb_port_status))
+    {
+        struct usb_port_status *ust =
+            (struct usb_port_status *)libusb_control_transfer_get_data(transfer);
+        *req->status = libusb_le16_to_cpu(ust->wPortStatus);
+    }
+    req->done = 1;
+    xfer_batch_done(req->batch);
+}
+
+
+/*
+ * Read status for all hub ports in portmask at once by submitting
+ * asynchronous GET_STATUS transfers and collecting completions from the
+ * libusb event loop, so the latency is one round trip instead of one
+ * per port. Results are stored in status[] indexed by port number,
+ * with -1 for ports that could not be read (like get_port_status()).
+ * Falls back to synchronous get_port_status() if submission fails.
+ */
+
+static void get_ports_status(struct libusb_device_handle *devh,
+    struct hub_info *hub, int portmask, int *status)
+{
+    struct port_status_request reqs[MAX_HUB_PORTS+1];
+    struct xfer_batch batch = { 1, 0 }; /* submitter's own reference */
+    int port;
+    int64_t pt = prof_start();
+    bzero(reqs, sizeof(reqs));
+    for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        status[port] = -1;
+    }
+#if defined(__gnu_linux__) || defined(__linux__)
+    /* Ports that sysfs can answer from kernel memory skip the bus entirely: */
+    if (!opt_nosysfs) {
+        get_ports_status_sysfs(devh, hub, portmask, status);
+    }
+#endif
+    for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+        if (status[port] >= 0) continue; /* already resolved via sysfs */
+        struct port_status_request *req = &reqs[port];
+        req->status = &status[port];
+        req->batch = &batch;
+        req->transfer = libusb_alloc_transfer(0);
+        if (req->transfer == NULL) {
+            status[port] = get_port_status(devh, port);
+            continue;
+        }
+        libusb_fill_control_setup(req->buf,
+            LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+            LIBUSB_REQUEST_GET_STATUS, 0, port, sizeof(struct usb_port_status));
+        libusb_fill_control_transfer(req->transfer, devh, req->buf,
+            port_status_completed, req, USB_CTRL_GET_TIMEOUT);
+        xfer_batch_ref(&batch);
+        if (libusb_submit_transfer(req->transfer) != 0) {
+            xfer_batch_done(&batch);
+            libusb_free_transfer(req->transfer);
+            req->transfer = NULL;
+            status[port] = get_port_status(devh, port);
+            continue;
+        }
+    }
+    xfer_batch_done(&batch); /* done submitting, drop our own reference */
+    int failures = 0;
+    while (!xfer_batch_completed(&batch)) {
+        int erc = libusb_handle_events_completed(NULL, &batch.completed);
+        if (erc == 0 || erc == LIBUSB_ERROR_INTERRUPTED) {
+            /* INTERRUPTED just means a signal arrived (e.g. SIGUSR1
+             * history dump) - the batch is still fine, keep pumping: */
+            continue;
+        }
+        if (++failures == 1) {
+            /* Event loop failed - cancel what is left and drain it: */
+            for (port = 1; port <= MAX_HUB_PORTS; port++) {
+                if (reqs[port].transfer && !reqs[port].done) {
+                    libusb_cancel_transfer(reqs[port].transfer);
+                }
+            }
+            continue;
+        }
+        if (failures > XFER_MAX_EVENT_FAILURES) {
+            /* Persistently broken event loop - stop waiting. Transfers
+             * whose callback never ran still belong to libusb and must
+             * be leaked, not freed: */
+            for (port = 1; port <= MAX_HUB_PORTS; port++) {
+                if (reqs[port].transfer && !reqs[port].done) {
+                    reqs[port].transfer = NULL;
+                }
+            }
+            break;
+        }
+    }
+    for (port = 1; port <= MAX_HUB_PORTS; port++) {
+        if (reqs[port].transfer) {
+            libusb_free_transfer(reqs[port].transfer);
+        }
+    }
+    /* Every status read feeds the transition history (no-op unless enabled): */
+    for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+        history_note(hub, port, status[port]);
+    }
+    prof_end(PROF_STATUS_BATCH, pt);
+}
+
+
+/*
+ * Wait until all selected hub ports report power off and no connection,
+ * polling port status instead of sleeping for a fixed delay. Compliant
+ * hubs drop power within tens of ms, so this usually returns much
+ * earlier than the max_delay upper bound.
+ * Returns time waited in milliseconds.
+ */
+
+static int wait_ports_off(struct libusb_device_handle *devh, struct hub_info *hub,
+    int ports, int max_delay)
+{
+    int64_t start = get_time_ms();
+    int power_mask = hub->super_speed ? USB_SS_PORT_STAT_POWER
+                                      : USB_PORT_STAT_POWER;
+    /* If this hub model's settle time was measured before, sleep it off
+     * in one go instead of burning status polls getting there: */
+    int seed = settle_find(hub);
+    int seeded = seed > POWER_POLL_INTERVAL_MS;
+    if (seeded) {
+        sleep_ms(seed <= max_delay ? seed : max_delay);
+    }
+    for (;;) {
+        int status[MAX_HUB_PORTS+1];
+        int all_off = 1;
+        int port;
+        get_ports_status(devh, hub, ports, status);
+        for (port = 1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+            if (((1 << (port-1)) & ports) == 0) continue;
+            if (status[port] < 0) continue; /* cannot tell, assume off */
+            if (status[port] & (power_mask | USB_PORT_STAT_CONNECTION)) {
+                all_off = 0;
+                break;
+            }
+        }
+        int elapsed = (int)(get_time_ms() - start);
+        if (all_off) {
+            /* Verified settle measurement - remember it for this model.
+             * A seeded run measures at least the seed itself, so feeding
+             * it back would ratchet the stored maximum up by one poll
+             * round every cycle; only learn from seeded runs when the
+             * hub demonstrably took longer than the seed: */
+            if (!seeded || elapsed > seed + POWER_POLL_INTERVAL_MS) {
+                settle_learn(hub, elapsed);
+            }
+            return elapsed;
+        }
+        if (elapsed >= max_delay) {
+            return elapsed;
+        }
+        sleep_ms(POWER_POLL_INTERVAL_MS);
+    }
+}
+
+
+#if defined(__gnu_linux__) || defined(__linux__)
+/*
+ * Try to use the Linux sysfs interface to power a port off/on.
+ * Returns 0 on success.
+ */
+
+static int set_port_status_linux(struct libusb_device_handle *devh, struct hub_info *hub, int port, int on)
+{
+    char disable_path[PATH_MAX];
+    struct sysfs_hub_cache *cache = sysfs_cache_get(hub);
+    int cacheable = (cache != NULL && port <= MAX_HUB_PORTS);
+    int disable_fd = -1;
+    int have_path = 0;
+    int rc = 0;
+
+    if (cacheable && cache->fd[port] != 0) {
+        if (cache->fd[port] < 0) {
+            return -1; /* known to be unavailable, don't retry the open() */
+        }
+        disable_fd = cache->fd[port];
+    } else {
+        int configuration = cacheable ? cache->configuration : -1;
+        if (configuration < 0) {
+            rc = libusb_get_configuration(devh, &configuration);
+            if (rc < 0) {
+                return rc;
+            }
+            if (cacheable) {
+                cache->configuration = configuration;
+            }
+        }
+
+        /*
+         * The "disable" sysfs interface is available only starting with kernel version 6.0.
+         * For earlier kernel versions the open() call will fail and we fall back to using libusb.
+         */
+        sysfs_port_path(disable_path, PATH_MAX, hub, configuration, port, "disable");
+        have_path = 1;
+
+        disable_fd = open(disable_path, O_WRONLY);
+        if (disable_fd >= 0 && cacheable) {
+            cache->fd[port] = disable_fd;
+        }
+    }
+
+    if (disable_fd >= 0) {
+        rc = pwrite(disable_fd, on ? "0" : "1", 1, 0);
+        if (!cacheable) {
+            close(disable_fd);
+        }
+    }
+
+    if (disable_fd < 0 || rc < 0) {
+        /*
+         * ENOENT is the expected error when running on Linux kernel < 6.0 where
+         * sysfs disable interface does not exist yet - no need to report anything in this case.
+         * If the file exists but another error occurs it is most likely a permission issue.
+         * Print an error message mostly geared towards setting up udev.
+         */
+        if (errno != ENOENT && have_path) {
+            fprintf(stderr,
+                "Failed to set port status by writing to %s (%s).\n"
+                "Follow https://git.io/JIB2Z to make sure that udev is set up correctly.\n"
+                "Falling back to libusb based port control.\n"
+                "Use -S to skip trying the sysfs interface and printing this message.\n",
+                disable_path, strerror(errno)
+            );
+        }
+        if (cacheable) {
+            if (cache->fd[port] > 0) {
+                close(cache->fd[port]);
+            }
+            cache->fd[port] = -1; /* don't retry on next operation */
+        }
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+
+/*
+ * Use a control transfer via libusb to turn a port off/on.
+ * Power off attempts are repeated up to opt_repeat times, but checking
+ * actual port status after each attempt: ports that obey the first
+ * CLEAR_FEATURE stop immediately and only stubborn hubs pay the repeat
+ * delays, with exponential backoff between attempts.
+ * Returns >= 0 on success.
+ */
+
+static int set_port_status_libusb(struct libusb_device_handle *devh,
+    struct hub_info *hub, int port, int on)
+{
+    int rc = 0;
+    int request = on ? LIBUSB_REQUEST_SET_FEATURE
+                     : LIBUSB_REQUEST_CLEAR_FEATURE;
+    int repeat = on ? 1 : opt_repeat;
+    int power_mask = hub->super_speed ? USB_SS_PORT_STAT_POWER
+                                      : USB_PORT_STAT_POWER;
+    int wait = opt_wait;
+
+    while (repeat-- > 0) {
+        /* Absolute deadline for the next attempt, anchored before the
+         * transfer so its own duration does not stretch the interval: */
+        int64_t next_attempt = get_time_us() + (int64_t)wait * 1000;
+        rc = libusb_control_transfer(devh,
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+            request, USB_PORT_FEAT_POWER,
+            port, NULL, 0, USB_CTRL_GET_TIMEOUT
+        );
+        if (rc < 0) {
+            perror("Failed to control port power!\n");
+        }
+        if (repeat > 0) {
+            if (!on) {
+                int port_status = get_port_status(devh, port);
+                if (port_status >= 0 && (port_status & power_mask) == 0) {
+                    /* Port is verified off, no need for more attempts */
+                    break;
+                }
+            }
+            sleep_until_us(next_attempt);
+            if (wait < 1000) {
+                wait *= 2;
+            }
+        }
+    }
+
+    return rc;
+}
+
+
+/*
+ * Try different methods to power a port off/on.
+ * Return >= 0 on success.
+ */
+
+static int set_port_status(struct libusb_device_handle *devh, struct hub_info *hub, int port, int on)
+{
+    int rc;
+    int64_t pt = prof_start();
+#if defined(__gnu_linux__) || defined(__linux__)
+    if (!opt_nosysfs) {
+        if (set_port_status_linux(devh, hub, port, on) == 0) {
+            prof_end(PROF_SET_STATUS, pt);
+            return 0;
+        }
+    }
+#endif
+
+    rc = set_port_status_libusb(devh, hub, port, on);
+    prof_end(PROF_SET_STATUS, pt);
+    return rc;
+}
+
+
+/* Context for one asynchronous SET/CLEAR_FEATURE port power request: */
+struct port_power_request {
+    unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE];
+    struct libusb_transfer *transfer;
+    int ok;
+    int done;       /* callback ran, libusb no longer owns the transfer */
+    struct xfer_batch *batch;
+};
+
+static void port_power_completed(struct libusb_transfer *transfer)
+{
+    struct port_power_request *req = transfer->user_data;
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        req->ok = 1;
+    }
+    req->done = 1;
+    xfer_batch_done(req->batch);
+}
+
+
+/*
+ * Flip power on all ports in portmask at once by submitting the
+ * SET/CLEAR_FEATURE transfers together and collecting completions from
+ * the libusb event loop, so switching a whole hub costs roughly one
+ * round trip instead of one per port.
+ * Returns bitmask of ports whose request completed; the caller falls
+ * back to the per-port path (with its retry logic) for the rest.
+ */
+
+static int set_ports_status_libusb(struct libusb_device_handle *devh,
+    struct hub_info *hub, int portmask, int on)
+{
+    struct port_power_request reqs[MAX_HUB_PORTS+1];
+    struct xfer_batch batch = { 1, 0 }; /* submitter's own reference */
+    int done_mask = 0;
+    int port;
+    int request = on ? LIBUSB_REQUEST_SET_FEATURE
+                     : LIBUSB_REQUEST_CLEAR_FEATURE;
+    int64_t pt = prof_start();
+    bzero(reqs, sizeof(reqs));
+    for (port=1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+        if ((portmask & (1 << (port-1))) == 0) continue;
+        struct port_power_request *req = &reqs[port];
+        req->batch = &batch;
+        req->transfer = libusb_alloc_transfer(0);
+        if (req->transfer == NULL) {
+            continue;
+        }
+        libusb_fill_control_setup(req->buf,
+            LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+            request, USB_PORT_FEAT_POWER, port, 0);
+        libusb_fill_control_transfer(req->transfer, devh, req->buf,
+            port_power_completed, req, USB_CTRL_GET_TIMEOUT);
+        xfer_batch_ref(&batch);
+        if (libusb_submit_transfer(req->transfer) != 0) {
+            xfer_batch_done(&batch);
+            libusb_free_transfer(req->transfer);
+            req->transfer = NULL;
+            continue;
+        }
+    }
+    xfer_batch_done(&batch); /* done submitting, drop our own reference */
+    int failures = 0;
+    while (!xfer_batch_completed(&batch)) {
+        int erc = libusb_handle_events_completed(NULL, &batch.completed);
+        if (erc == 0 || erc == LIBUSB_ERROR_INTERRUPTED) {
+            /* INTERRUPTED just means a signal arrived (e.g. SIGUSR1
+             * history dump) - the batch is still fine, keep pumping: */
+            continue;
+        }
+        if (++failures == 1) {
+            /* Event loop failed - cancel what is left and drain it: */
+            for (port = 1; port <= MAX_HUB_PORTS; port++) {
+                if (reqs[port].transfer && !reqs[port].done) {
+                    libusb_cancel_transfer(reqs[port].transfer);
+                }
+            }
+            continue;
+        }
+        if (failures > XFER_MAX_EVENT_FAILURES) {
+            /* Persistently broken event loop - stop waiting. Transfers
+             * whose callback never ran still belong to libusb and must
+             * be leaked, not freed: */
+            for (port = 1; port <= MAX_HUB_PORTS; port++) {
+                if (reqs[port].transfer && !reqs[port].done) {
+                    reqs[port].transfer = NULL;
+                }
+            }
+            break;
+        }
+    }
+    for (port = 1; port <= MAX_HUB_PORTS; port++) {
+        if (reqs[port].transfer) {
+            libusb_free_transfer(reqs[port].transfer);
+            if (reqs[port].ok) {
+                done_mask |= 1 << (port-1);
+            }
+        }
+    }
+    prof_end(PROF_SET_STATUS, pt);
+    return done_mask;
+}
+
+
+/*
+ * Get USB device descriptor strings and summary description.
+ *
+ * Summary will use following format:
+ *
+ *    "<vid:pid> <vendor> <product> <serial>, <USB x.yz, N ports>"
+ *
+ * vid:pid will be always present, but vendor, product or serial
+ * may be skipped if they are empty or not enough permissions to read them.
+ * <USB x.yz, N ports> will be present only for USB hubs.
+ *
+ * Returns 0 for success and error code for failure.
+ * In case of failure return buffer is not altered.
+ */
+
+#if !defined(UHUBCTL_MINIMAL)
+/*
+ * Fetch string descriptor and convert it to ASCII, like
+ * libusb_get_string_descriptor_ascii() but with adjustable timeout.
+ * Returns string length on success and negative error code on failure.
+ */
+
+static int get_string_descriptor_ascii_to(struct libusb_device_handle *devh,
+    uint8_t index, char *buf, int size, int timeout)
+{
+    unsigned char tbuf[255];
+    int rc, langid, len, si, di;
+
+    /* Get language id from string descriptor 0: */
+    rc = libusb_control_transfer(devh,
+        LIBUSB_ENDPOINT_IN,
+        LIBUSB_REQUEST_GET_DESCRIPTOR,
+        LIBUSB_DT_STRING << 8, 0,
+        tbuf, sizeof(tbuf), timeout
+    );
+    if (rc < 4) {
+        return rc < 0 ? rc : LIBUSB_ERROR_IO;
+    }
+    langid = tbuf[2] | (tbuf[3] << 8);
+
+    rc = libusb_control_transfer(devh,
+        LIBUSB_ENDPOINT_IN,
+        LIBUSB_REQUEST_GET_DESCRIPTOR,
+        (LIBUSB_DT_STRING << 8) | index, langid,
+        tbuf, sizeof(tbuf), timeout
+    );
+    if (rc < 2) {
+        return rc < 0 ? rc : LIBUSB_ERROR_IO;
+    }
+    len = tbuf[0] < rc ? tbuf[0] : rc;
+    /* Crude UTF-16LE to ASCII conversion, like libusb does it: */
+    for (si=2, di=0; si+1 < len && di < size-1; si+=2) {
+        buf[di++] = tbuf[si+1] ? '?' : tbuf[si];
+    }
+    buf[di] = 0;
+    return di;
+}
+
+
+/*
+ * Read one device string with adaptive timeout: start with the fast
+ * timeout and escalate to the full one only on first contact with a
+ * slow device, so healthy devices never wait and wedged ones cannot
+ * stall us for 5 seconds per descriptor.
+ */
+
+static int read_device_string(struct libusb_device_handle *devh,
+    uint8_t index, char *buf, int size, int *timeout)
+{
+    int64_t pt = prof_start();
+    int budget = scan_timeout_ms();
+    int rc = get_string_descriptor_ascii_to(devh, index, buf, size,
+        *timeout < budget ? *timeout : budget);
+    if (rc == LIBUSB_ERROR_TIMEOUT && *timeout < USB_CTRL_GET_TIMEOUT) {
+        *timeout = USB_CTRL_GET_TIMEOUT;
+        rc = get_string_descriptor_ascii_to(devh, index, buf, size,
+            *timeout < budget ? *timeout : budget);
+    }
+    prof_end(PROF_STRING_DESC, pt);
+    return rc;
+}
+
+
+static int get_device_description_uncached(struct libusb_device * dev, struct descriptor_strings * ds)
+{
+    int rc;
+    int id_vendor  = 0;
+    int id_product = 0;
+    char hub_specific[64] = "";
+    struct libusb_device_descriptor desc;
+    struct libusb_device_handle *devh = NULL;
+    rc = libusb_get_device_descriptor(dev, &desc);
+    if (rc)
+        return rc;
+    bzero(ds, sizeof(*ds));
+    id_vendor  = desc.idVendor;
+    id_product = desc.idProduct;
+    rc = libusb_open(dev, &devh);
+    if (rc == 0) {
+        if (!opt_nodesc && !neg_cache_find(dev, &desc)) {
+            int timeout = USB_STRING_FAST_TIMEOUT;
+            if (desc.iManufacturer) {
+                rc = read_device_string(devh,
+                    desc.iManufacturer, ds->vendor, sizeof(ds->vendor), &timeout);
+                rtrim(ds->vendor);
+            }
+            if (rc >= 0 && desc.iProduct) {
+                rc = read_device_string(devh,
+                    desc.iProduct, ds->product, sizeof(ds->product), &timeout);
+                rtrim(ds->product);
+            }
+            if (rc >= 0 && desc.iSerialNumber) {
+                rc = read_device_string(devh,
+                    desc.iSerialNumber, ds->serial, sizeof(ds->serial), &timeout);
+                rtrim(ds->serial);
+            }
+            if (rc == LIBUSB_ERROR_TIMEOUT) {
+                /* Device is unresponsive even at full timeout -
+                 * skip its strings on subsequent runs: */
+                neg_cache_add(dev, &desc);
+            }
+        }
+        if (desc.bDeviceClass == LIBUSB_CLASS_HUB) {
+            struct hub_info info;
+            bzero(&info, sizeof(info));
+            rc = get_hub_info(dev, &info);
+            if (rc == 0) {
+                const char * lpsm_type;
+                if (info.lpsm == HUB_CHAR_INDV_PORT_LPSM) {
+                    lpsm_type = "ppps";
+                } else if (info.lpsm == HUB_CHAR_COMMON_LPSM) {
+                    lpsm_type = "ganged";
+                } else {
+                    lpsm_type = "nops";
+                }
+                snprintf(hub_specific, sizeof(hub_specific), ", USB %x.%02x, %d ports, %s",
+                   info.bcd_usb >> 8, info.bcd_usb & 0xFF, info.nports, lpsm_type);
+            }
+        }
+        libusb_close(devh);
+    }
+    snprintf(ds->description, sizeof(ds->description),
+        "%04x:%04x%s%s%s%s%s%s%s",
+        id_vendor, id_product,
+        ds->vendor[0]  ? " " : "", ds->vendor,
+        ds->product[0] ? " " : "", ds->product,
+        ds->serial[0]  ? " " : "", ds->serial,
+        hub_specific
+    );
+    return 0;
+}
+
+
+/*
+ * Per-invocation memoization cache for get_device_description().
+ * String descriptor reads are slow (often tens of ms each) and the same
+ * device is described by hub discovery, --search matching and the port
+ * status printer, so fetch each device's strings over the wire once and
+ * replay them from memory afterwards. Keyed by libusb_device pointer,
+ * which is stable for the lifetime of one device list.
+ */
+
+struct desc_cache_entry {
+    struct libusb_device *dev;
+    struct descriptor_strings ds;
+};
+
+static struct desc_cache_entry *desc_cache = NULL;
+static int desc_cache_count = 0;
+static int desc_cache_size = 0;
+#if !defined(_WIN32)
+static pthread_mutex_t desc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void desc_cache_acquire(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_lock(&desc_cache_lock);
+#endif
+}
+
+static void desc_cache_release(void)
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&desc_cache_lock);
+#endif
+}
+
+/* Drop cached description of one device (e.g. after it was unplugged): */
+static void desc_cache_forget(struct libusb_device *dev)
+{
+    int i;
+    desc_cache_acquire();
+    for (i=0; i<desc_cache_count; i++) {
+        if (desc_cache[i].dev == dev) {
+            memmove(&desc_cache[i], &desc_cache[i+1],
+                (desc_cache_count - i - 1) * sizeof(desc_cache[0]));
+            desc_cache_count--;
+            break;
+        }
+    }
+    desc_cache_release();
+}
+
+/* Drop all cached descriptions (device pointers die with the device list): */
+static void desc_cache_clear(void)
+{
+    desc_cache_acquire();
+    free(desc_cache);
+    desc_cache = NULL;
+    desc_cache_count = 0;
+    desc_cache_size = 0;
+    desc_cache_release();
+}
+
+
+/* Non-fetching cache lookup, so --search can check already-known
+ * descriptions before paying for any new descriptor I/O: */
+static int desc_cache_peek(struct libusb_device *dev, struct descriptor_strings *ds)
+{
+    int i;
+    int hit = 0;
+    desc_cache_acquire();
+    for (i=0; i<desc_cache_count; i++) {
+        if (desc_cache[i].dev == dev) {
+            memcpy(ds, &desc_cache[i].ds, sizeof(*ds));
+            hit = 1;
+            break;
+        }
+    }
+    desc_cache_release();
+    return hit;
+}
+
+
+/*
+ * Memoizing wrapper around get_device_description_uncached().
+ * Same interface; only successful lookups are cached, failures are
+ * retried on next call.
+ */
+
+static int get_device_description(struct libusb_device * dev, struct descriptor_strings * ds)
+{
+    int i, rc;
+    desc_cache_acquire();
+    for (i=0; i<desc_cache_count; i++) {
+        if (desc_cache[i].dev == dev) {
+            memcpy(ds, &desc_cache[i].ds, sizeof(*ds));
+            desc_cache_release();
+            return 0;
+        }
+    }
+    desc_cache_release();
+
+    rc = get_device_description_uncached(dev, ds);
+    if (rc != 0) {
+        return rc;
+    }
+
+    desc_cache_acquire();
+    /* Parallel scan workers may have raced us here - recheck before adding: */
+    for (i=0; i<desc_cache_count; i++) {
+        if (desc_cache[i].dev == dev)
+            break;
+    }
+    if (i == desc_cache_count) {
+        if (desc_cache_count >= desc_cache_size) {
+            int new_size = desc_cache_size ? desc_cache_size * 2 : 64;
+            struct desc_cache_entry *grown = realloc(desc_cache, new_size * sizeof(*grown));
+            if (grown == NULL) {
+                desc_cache_release();
+                return 0; /* cannot cache, but description itself is fine */
+            }
+            desc_cache = grown;
+            desc_cache_size = new_size;
+        }
+        desc_cache[desc_cache_count].dev = dev;
+        memcpy(&desc_cache[desc_cache_count].ds, ds, sizeof(*ds));
+        desc_cache_count++;
+    }
+    desc_cache_release();
+    return 0;
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+
+/*
+ * Topology index mapping bus + port path to the device attached there.
+ * Built once per device list, then child lookups for the status printer
+ * and --search matching are O(1) instead of scanning all of usb_devs[]
+ * with libusb calls in the inner loop.
+ */
+
+#if !defined(UHUBCTL_MINIMAL)
+struct topo_entry {
+    struct libusb_device *dev;
+    uint8_t bus;
+    uint8_t pn_len;
+    uint8_t port_numbers[MAX_HUB_CHAIN];
+};
+
+static struct topo_entry *topo_table = NULL;
+static int topo_size = 0; /* power of two */
+
+static uint32_t topo_hash(uint8_t bus, const uint8_t *pn, int pn_len)
+{
+    /* FNV-1a over bus + port path */
+    uint32_t hash = 2166136261u ^ bus;
+    int i;
+    for (i=0; i<pn_len; i++) {
+        hash = (hash ^ pn[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void topo_index_clear(void)
+{
+    free(topo_table);
+    topo_table = NULL;
+    topo_size = 0;
+}
+
+static void topo_index_build(void)
+{
+    struct libusb_device *dev;
+    int ndevs = 0;
+    int i = 0;
+    while (usb_devs[ndevs] != NULL) {
+        ndevs++;
+    }
+    topo_size = 16;
+    while (topo_size < 2 * ndevs) {
+        topo_size *= 2;
+    }
+    topo_table = calloc(topo_size, sizeof(*topo_table));
+    if (topo_table == NULL) {
+        topo_size = 0;
+        return;
+    }
+    while ((dev = usb_devs[i++]) != NULL) {
+        struct topo_entry entry;
+        entry.dev = dev;
+        entry.bus = libusb_get_bus_number(dev);
+        int pn_len = get_port_numbers(dev, entry.port_numbers, sizeof(entry.port_numbers));
+        if (pn_len < 0) {
+            continue;
+        }
+        entry.pn_len = pn_len;
+        uint32_t slot = topo_hash(entry.bus, entry.port_numbers, entry.pn_len) & (topo_size - 1);
+        while (topo_table[slot].dev != NULL) {
+            slot = (slot + 1) & (topo_size - 1);
+        }
+        topo_table[slot] = entry;
+    }
+}
+
+
+/*
+ * Find device attached to given port of a hub (identified by its
+ * bus + port path), or NULL if that port is empty.
+ * Falls back to linear usb_devs[] scan if the index could not be built.
+ */
+
+static struct libusb_device* topo_find_child(uint8_t bus, const uint8_t *pn, int pn_len, int port)
+{
+    if (pn_len + 1 > MAX_HUB_CHAIN) {
+        return NULL;
+    }
+    uint8_t key[MAX_HUB_CHAIN];
+    memcpy(key, pn, pn_len);
+    key[pn_len] = port;
+
+    if (topo_table == NULL) {
+        topo_index_build();
+    }
+    if (topo_table == NULL) {
+        /* Index allocation failed - scan the device list directly: */
+        struct libusb_device *udev;
+        int i = 0;
+        while ((udev = usb_devs[i++]) != NULL) {
+            uint8_t dev_pn[MAX_HUB_CHAIN];
+            if (libusb_get_bus_number(udev) != bus)
+                continue;
+            int dev_plen = get_port_numbers(udev, dev_pn, sizeof(dev_pn));
+            if (dev_plen == pn_len + 1 && memcmp(key, dev_pn, dev_plen) == 0) {
+                return udev;
+            }
+        }
+        return NULL;
+    }
+
+    uint32_t slot = topo_hash(bus, key, pn_len + 1) & (topo_size - 1);
+    while (topo_table[slot].dev != NULL) {
+        struct topo_entry *entry = &topo_table[slot];
+        if (entry->bus == bus &&
+            entry->pn_len == pn_len + 1 &&
+            memcmp(entry->port_numbers, key, pn_len + 1) == 0)
+        {
+            return entry->dev;
+        }
+        slot = (slot + 1) & (topo_size - 1);
+    }
+    return NULL;
+}
+#else
+static void topo_index_clear(void)
+{
+    /* The index only serves child lookups, which minimal builds do not do */
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+
+/*
+ * Growable output buffer. Port status for a whole hub is serialized
+ * here and flushed with a single write, instead of dozens of tiny
+ * printf() calls per port.
+ */
+
+struct out_buf {
+    char *data;
+    int len;
+    int cap;
+};
+
+static int out_appendf(struct out_buf *ob, const char *fmt, ...)
+{
+    va_list ap;
+    for (;;) {
+        int avail = ob->cap - ob->len;
+        va_start(ap, fmt);
+        int need = vsnprintf(ob->data ? ob->data + ob->len : NULL,
+                             ob->data ? avail : 0, fmt, ap);
+        va_end(ap);
+        if (need < 0) {
+            return -1;
+        }
+        if (ob->data && need < avail) {
+            ob->len += need;
+            return 0;
+        }
+        int newcap = ob->cap ? ob->cap : 4096;
+        while (newcap - ob->len <= need) {
+            newcap *= 2;
+        }
+        char *p = realloc(ob->data, newcap);
+        if (p == NULL) {
+            return -1;
+        }
+        ob->data = p;
+        ob->cap = newcap;
+    }
+}
+
+/* Append string as JSON value, quoting and escaping as needed */
+
+static void out_append_json_string(struct out_buf *ob, const char *str)
+{
+    out_appendf(ob, "\"");
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            out_appendf(ob, "\\%c", c);
+        } else if (c < 0x20) {
+            out_appendf(ob, "\\u%04x", c);
+        } else {
+            out_appendf(ob, "%c", c);
+        }
+    }
+    out_appendf(ob, "\"");
+}
+
+static void out_flush(struct out_buf *ob)
+{
+    if (ob->data) {
+#if defined(_WIN32)
+        fwrite(ob->data, 1, ob->len, stdout);
+        fflush(stdout);
+#else
+        fflush(stdout); /* keep ordering with earlier printf output */
+        int off = 0;
+        while (off < ob->len) {
+            ssize_t n = write(STDOUT_FILENO, ob->data + off, ob->len - off);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+#endif
+        free(ob->data);
+    }
+    ob->data = NULL;
+    ob->len = 0;
+    ob->cap = 0;
+}
+
+
+/*
+ * Decode wPortStatus bits into short flag names as shown in status
+ * output, in stable order. Returns number of names stored (up to max).
+ */
+
+static int port_status_flags(struct hub_info *hub, int port_status, const char **names, int max)
+{
+    int n = 0;
+#define ADD_FLAG(name) do { if (n < max) names[n++] = name; } while (0)
+    if (!hub->super_speed) {
+        if (port_status == 0) {
+            ADD_FLAG("off");
+        } else {
+            if (port_status & USB_PORT_STAT_POWER)        ADD_FLAG("power");
+            if (port_status & USB_PORT_STAT_INDICATOR)    ADD_FLAG("indicator");
+            if (port_status & USB_PORT_STAT_TEST)         ADD_FLAG("test");
+            if (port_status & USB_PORT_STAT_HIGH_SPEED)   ADD_FLAG("highspeed");
+            if (port_status & USB_PORT_STAT_LOW_SPEED)    ADD_FLAG("lowspeed");
+            if (port_status & USB_PORT_STAT_SUSPEND)      ADD_FLAG("suspend");
+        }
+    } else {
+        if (!(port_status & USB_SS_PORT_STAT_POWER)) {
+            ADD_FLAG("off");
+        } else {
+            int link_state = port_status & USB_PORT_STAT_LINK_STATE;
+            if (port_status & USB_SS_PORT_STAT_POWER)     ADD_FLAG("power");
+            if ((port_status & USB_SS_PORT_STAT_SPEED)
+                 == USB_PORT_STAT_SPEED_5GBPS)
+            {
+                ADD_FLAG("5gbps");
+            }
+            if (link_state == USB_SS_PORT_LS_U0)          ADD_FLAG("U0");
+            if (link_state == USB_SS_PORT_LS_U1)          ADD_FLAG("U1");
+            if (link_state == USB_SS_PORT_LS_U2)          ADD_FLAG("U2");
+            if (link_state == USB_SS_PORT_LS_U3)          ADD_FLAG("U3");
+            if (link_state == USB_SS_PORT_LS_SS_DISABLED) ADD_FLAG("SS.Disabled");
+            if (link_state == USB_SS_PORT_LS_RX_DETECT)   ADD_FLAG("Rx.Detect");
+            if (link_state == USB_SS_PORT_LS_SS_INACTIVE) ADD_FLAG("SS.Inactive");
+            if (link_state == USB_SS_PORT_LS_POLLING)     ADD_FLAG("Polling");
+            if (link_state == USB_SS_PORT_LS_RECOVERY)    ADD_FLAG("Recovery");
+            if (link_state == USB_SS_PORT_LS_HOT_RESET)   ADD_FLAG("HotReset");
+            if (link_state == USB_SS_PORT_LS_COMP_MOD)    ADD_FLAG("Compliance");
+            if (link_state == USB_SS_PORT_LS_LOOPBACK)    ADD_FLAG("Loopback");
+        }
+    }
+    if (port_status & USB_PORT_STAT_RESET)       ADD_FLAG("reset");
+    if (port_status & USB_PORT_STAT_OVERCURRENT) ADD_FLAG("oc");
+    if (port_status & USB_PORT_STAT_ENABLE)      ADD_FLAG("enable");
+    if (port_status & USB_PORT_STAT_CONNECTION)  ADD_FLAG("connect");
+#undef ADD_FLAG
+    return n;
+}
+
+
+/*
+ * show status for hub ports
+ * portmask is bitmap of ports to display
+ * if portmask is 0, show all ports
+ * Depending on --format, emits human text, one JSON object per hub
+ * (JSON lines, streaming friendly) or one TSV row per port.
+ */
+
+static int print_port_status(struct hub_info * hub, int portmask)
+{
+    int port_status;
+    struct libusb_device_handle * devh = NULL;
+    int rc = 0;
+    struct libusb_device *dev = hub->dev;
+    struct out_buf ob = { NULL, 0, 0 };
+    rc = libusb_open(dev, &devh);
+    if (rc == 0) {
+        int port;
+        int nout = 0;
+        int status[MAX_HUB_PORTS+1];
+        get_ports_status(devh, hub, portmask, status);
+        if (opt_format == FORMAT_JSON) {
+            out_appendf(&ob, "{\"location\":");
+            out_append_json_string(&ob, hub->location);
+            out_appendf(&ob, ",\"vendor\":");
+            out_append_json_string(&ob, hub->vendor);
+            out_appendf(&ob, ",\"description\":");
+            out_append_json_string(&ob, hub_description(hub));
+            out_appendf(&ob, ",\"nports\":%d,\"super_speed\":%s,\"ports\":[",
+                hub->nports, hub->super_speed ? "true" : "false");
+        }
+        for (port = 1; port <= hub->nports; port++) {
+            if (portmask > 0 && (portmask & (1 << (port-1))) == 0) continue;
+
+            port_status = port <= MAX_HUB_PORTS ? status[port]
+                                                : get_port_status(devh, port);
+            if (port_status == -1) {
+                fprintf(stderr,
+                    "cannot read port %d status, %s (%d)\n",
+                    port, strerror(errno), errno);
+                break;
+            }
+
+#if !defined(UHUBCTL_MINIMAL)
+            struct descriptor_strings ds;
+            bzero(&ds, sizeof(ds));
+            struct libusb_device * udev;
+            udev = topo_find_child(hub->bus, hub->port_numbers, hub->pn_len, port);
+            if (udev) {
+                get_device_description(udev, &ds);
+            }
+            const char *description = ds.description;
+#else
+            const char *description = "";
+#endif
+
+            const char *flags[20];
+            int nflags = port_status_flags(hub, port_status, flags, 20);
+            int connected = (port_status & USB_PORT_STAT_CONNECTION) != 0;
+            int i;
+
+            switch (opt_format) {
+            case FORMAT_JSON:
+                out_appendf(&ob, "%s{\"port\":%d,\"status\":\"%04x\",\"flags\":[",
+                    nout ? "," : "", port, port_status);
+                for (i=0; i<nflags; i++) {
+                    out_appendf(&ob, "%s\"%s\"", i ? "," : "", flags[i]);
+                }
+                out_appendf(&ob, "]");
+                if (connected) {
+                    out_appendf(&ob, ",\"description\":");
+                    out_append_json_string(&ob, description);
+                }
+                out_appendf(&ob, "}");
+                break;
+            case FORMAT_TSV:
+                out_appendf(&ob, "%s\t%d\t%04x\t", hub->location, port, port_status);
+                for (i=0; i<nflags; i++) {
+                    out_appendf(&ob, "%s%s", i ? " " : "", flags[i]);
+                }
+                out_appendf(&ob, "\t%s\n", connected ? description : "");
+                break;
+            default:
+                out_appendf(&ob, "  Port %d: %04x", port, port_status);
+                for (i=0; i<nflags; i++) {
+                    out_appendf(&ob, " %s", flags[i]);
+                }
+                if (connected) {
+                    out_appendf(&ob, " [%s]", description);
+                }
+                out_appendf(&ob, "\n");
+            }
+            nout++;
+        }
+        if (opt_format == FORMAT_JSON) {
+            out_appendf(&ob, "]}\n");
+        }
+        out_flush(&ob);
+        libusb_close(devh);
+    }
+    return 0;
+}
+
+
+/*
+ * Apply location/level/vendor constraints to given hub.
+ * Clears actionable flag if hub does not match.
+ */
+
+static void apply_hub_filters(struct hub_info *info)
+{
+    if (strlen(opt_location) > 0) {
+        if (strcasecmp(opt_location, info->location)) {
+            info->actionable = 0;
+        }
+    }
+    if (opt_level > 0) {
+        if (opt_level != info->pn_len + 1) {
+            info->actionable = 0;
+        }
+    }
+    if (strlen(opt_vendor) > 0) {
+        if (strncasecmp(opt_vendor, info->vendor, strlen(opt_vendor))) {
+            info->actionable = 0;
+        }
+    }
+}
+
+
+/*
+ * Resolve USB2/3 hub duality (unless -e is used) and
+ * recompute hub_phys_count over the hubs[] array.
+ */
+
+/*
+ * Reserve and return the next hubs[] slot, growing the array as needed.
+ * Returns NULL if memory allocation failed.
+ * Growth can move the array, which invalidates hub pointers held by
+ * the sysfs fd cache, so that cache is dropped when it happens.
+ */
+
+static struct hub_info* hub_new(void)
+{
+    if (hub_count == hub_capacity) {
+        int newcap = hub_capacity ? hub_capacity * 2 : 16;
+        struct hub_info *p = realloc(hubs, newcap * sizeof(*hubs));
+        if (p == NULL) {
+            return NULL;
+        }
+#if defined(__gnu_linux__) || defined(__linux__)
+        if (p != hubs) {
+            sysfs_cache_clear();
+        }
+#endif
+        hubs = p;
+        hub_capacity = newcap;
+    }
+    return &hubs[hub_count++];
+}
+
+
+#if !defined(UHUBCTL_MINIMAL)
+/* Number of container ID hash buckets for dual matching (power of two): */
+#define DUAL_MATCH_BUCKETS 256
+
+static uint32_t container_id_hash(const uint8_t *container_id)
+{
+    /* FNV-1a over the 16 raw container ID bytes */
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i=0; i<16; i++) {
+        hash = (hash ^ container_id[i]) * 16777619u;
+    }
+    return hash;
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+#if !defined(UHUBCTL_MINIMAL)
+/*
+ * Score how likely hubs i and j are the USB2 and USB3 halves of the
+ * same physical device: -1 if they cannot match, otherwise 1-5 with
+ * higher values meaning stronger port path similarity.
+ */
+static int usb_dual_score(int i, int j)
+{
+    /* Hub and its dual must be different types: one USB2, another USB3: */
+    if (hubs[i].super_speed == hubs[j].super_speed)
+        return -1;
+
+    /* Per USB 3.0 spec chapter 11.2, container IDs must be present and match: */
+    if (!hubs[i].has_container_id || !hubs[j].has_container_id)
+        return -1;
+    if (memcmp(hubs[i].container_id, hubs[j].container_id,
+            sizeof(hubs[i].container_id)) != 0)
+        return -1;
+
+    /* At this point, it should be enough to claim a match.
+     * However, some devices use hardcoded non-unique container ID.
+     * We should do few more checks below if multiple such devices are present.
+     */
+
+    /* Hubs should have the same number of ports */
+    if (hubs[i].nports != hubs[j].nports) {
+        /* Except for some weird hubs like Apple mini-dock (has 2 usb2 + 1 usb3 ports) */
+        if (hubs[i].nports + hubs[j].nports > 3) {
+            return -1;
+        }
+    }
+
+    /* If serial numbers are both present, they must match: */
+    if ((strlen(hubs[i].ds.serial) > 0 && strlen(hubs[j].ds.serial) > 0) &&
+        strcmp(hubs[i].ds.serial, hubs[j].ds.serial) != 0)
+    {
+        return -1;
+    }
+
+    /* We have a possible candidate - check for various levels of
+     * USB2 vs USB3 path similarity to rank it: */
+    int score = 1;
+
+    uint8_t* p1 = hubs[i].port_numbers;
+    uint8_t* p2 = hubs[j].port_numbers;
+    int l1 = hubs[i].pn_len;
+    int l2 = hubs[j].pn_len;
+    int s1 = hubs[i].super_speed;
+    int s2 = hubs[j].super_speed;
+
+    /* Check if port path is the same after removing top level (needed for M1 Macs): */
+    if (l1 >= 1 && l1 == l2 && memcmp(p1 + 1, p2 + 1, l1 - 1)==0) {
+        score = 2;
+    }
+
+    /* Raspberry Pi 4B hack (USB2 hub is one level deeper than USB3): */
+    if (is_rpi_4b && l1 + s1 == l2 + s2 && l1 >= s2 && memcmp(p1 + s2, p2 + s1, l1 - s2)==0) {
+        score = 3;
+    }
+    /* Check if port path is exactly the same: */
+    if (l1 == l2 && memcmp(p1, p2, l1)==0) {
+        score = 4;
+        /* Give even higher priority if `usb2bus + 1 == usb3bus` (Linux specific): */
+        if (hubs[i].bus - s1 == hubs[j].bus - s2) {
+            score = 5;
+        }
+    }
+    return score;
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+static void usb_match_duals_and_count(void)
+{
+    int i;
+#if !defined(UHUBCTL_MINIMAL)
+    int j;
+    int *bucket_next = NULL;
+    if (!opt_exact && hub_count > 0) {
+        bucket_next = malloc(hub_count * sizeof(*bucket_next));
+    }
+    if (bucket_next != NULL) {
+        /* Bucket hubs by container ID hash, so dual matching below only
+         * compares hubs that can actually match - O(n) instead of O(n^2): */
+        int bucket_head[DUAL_MATCH_BUCKETS];
+        memset(bucket_head, -1, sizeof(bucket_head));
+        for (j=0; j<hub_count; j++) {
+            bucket_next[j] = -1;
+            if (!hubs[j].has_container_id)
+                continue;
+            uint32_t bucket = container_id_hash(hubs[j].container_id) & (DUAL_MATCH_BUCKETS - 1);
+            bucket_next[j] = bucket_head[bucket];
+            bucket_head[bucket] = j;
+        }
+
+        /* Handle USB2/3 duality: */
+        for (i=0; i<hub_count; i++) {
+            /* Check only actionable hubs: */
+            if (hubs[i].actionable != 1)
+                continue;
+            /* Must have container ID: */
+            if (!hubs[i].has_container_id)
+                continue;
+            int best_match = -1;
+            int best_score = -1;
+            uint32_t bucket = container_id_hash(hubs[i].container_id) & (DUAL_MATCH_BUCKETS - 1);
+            for (j=bucket_head[bucket]; j>=0; j=bucket_next[j]) {
+                if (i==j)
+                    continue;
+
+                /* Find hub which is USB2/3 dual to the hub above */
+                int score = usb_dual_score(i, j);
+                if (score > best_score && score >= 0) {
+                    best_score = score;
+                    best_match = j;
+                }
+            }
+            if (best_match >= 0) {
+                if (!hubs[best_match].actionable) {
+                    /* Use 2 to signify that this is derived dual device */
+                    hubs[best_match].actionable = 2;
+                }
+            }
+        }
+        free(bucket_next);
+    }
+#endif /* !UHUBCTL_MINIMAL */
+    hub_phys_count = 0;
+    for (i=0; i<hub_count; i++) {
+        if (!hubs[i].actionable)
+            continue;
+#if defined(UHUBCTL_MINIMAL)
+        /* Without dual matching, every actionable hub is physical: */
+        hub_phys_count++;
+#else
+        if (!hubs[i].super_speed || opt_exact) {
+            hub_phys_count++;
+        }
+#endif
+    }
+}
+
+
+#if !defined(UHUBCTL_MINIMAL)
+/*
+ * Find the USB2/3 dual of one hub among discovered hubs, if any.
+ * Used where hubs are resolved directly by location (batch mode)
+ * rather than through the actionable marking above, so that acting on
+ * either half of a pair covers the whole physical hub.
+ */
+static struct hub_info *hub_find_dual(struct hub_info *hub)
+{
+    int i = (int)(hub - hubs);
+    int j;
+    int best_match = -1;
+    int best_score = -1;
+    if (opt_exact) {
+        return NULL;
+    }
+    for (j=0; j<hub_count; j++) {
+        if (j == i)
+            continue;
+        int score = usb_dual_score(i, j);
+        if (score > best_score && score >= 0) {
+            best_score = score;
+            best_match = j;
+        }
+    }
+    return best_match >= 0 ? &hubs[best_match] : NULL;
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+
+/* One hub probe unit for usb_find_hubs() scanning: */
+struct scan_task {
+    struct libusb_device *dev;
+    struct libusb_device_descriptor desc;
+    struct hub_info info;
+    int rc;
+    int desc_ok;  /* device descriptor was read successfully */
+    int cached;   /* filled from hub topology cache, no probing needed */
+    int unprobed; /* skipped because the scan budget ran out first */
+};
+
+/* Max number of concurrent hub probing threads */
+#define SCAN_MAX_THREADS 4
+
+#if !defined(_WIN32)
+struct scan_work {
+    struct scan_task *tasks;
+    int ntasks;
+    int next;
+    pthread_mutex_t lock;
+};
+
+static void* scan_worker(void *arg)
+{
+    struct scan_work *work = arg;
+    for (;;) {
+        struct scan_task *task;
+        pthread_mutex_lock(&work->lock);
+        int idx = work->next++;
+        pthread_mutex_unlock(&work->lock);
+        if (idx >= work->ntasks)
+            break;
+        task = &work->tasks[idx];
+        if (task->cached)
+            continue;
+        if (scan_budget_expired()) {
+            task->rc = LIBUSB_ERROR_TIMEOUT;
+            task->unprobed = 1;
+            continue;
+        }
+        int64_t pt = prof_start();
+        task->rc = get_hub_info(task->dev, &task->info);
+        prof_end(PROF_HUB_PROBE, pt);
+#if !defined(UHUBCTL_MINIMAL)
+        if (task->rc == 0) {
+            get_device_description(task->dev, &task->info.ds);
+        }
+#endif
+    }
+    return NULL;
+}
+#endif
+
+
+/*
+ * Probe all uncached scan tasks with get_hub_info() and
+ * get_device_description(). Probing runs on a small thread pool
+ * (libusb permits per-thread device handles), so enumeration wall time
+ * is bounded by the slowest hubs rather than the sum of all of them.
+ * Falls back to serial probing on Windows or if threads cannot start.
+ */
+
+static void scan_probe_tasks(struct scan_task *tasks, int ntasks, int nprobe)
+{
+    int i;
+#if !defined(_WIN32)
+    if (nprobe > 1) {
+        pthread_t threads[SCAN_MAX_THREADS];
+        struct scan_work work = { tasks, ntasks, 0, PTHREAD_MUTEX_INITIALIZER };
+        int nthreads = nprobe < SCAN_MAX_THREADS ? nprobe : SCAN_MAX_THREADS;
+        int started = 0;
+        for (i=0; i<nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, scan_worker, &work) != 0)
+                break;
+            started++;
+        }
+        if (started > 0) {
+            for (i=0; i<started; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            return;
+        }
+    }
+#else
+    (void)nprobe;
+#endif
+    for (i=0; i<ntasks; i++) {
+        struct scan_task *task = &tasks[i];
+        if (task->cached)
+            continue;
+        if (scan_budget_expired()) {
+            task->rc = LIBUSB_ERROR_TIMEOUT;
+            task->unprobed = 1;
+            continue;
+        }
+        int64_t pt = prof_start();
+        task->rc = get_hub_info(task->dev, &task->info);
+        prof_end(PROF_HUB_PROBE, pt);
+#if !defined(UHUBCTL_MINIMAL)
+        if (task->rc == 0) {
+            get_device_description(task->dev, &task->info.ds);
+        }
+#endif
+    }
+}
+
+
+#if !defined(UHUBCTL_MINIMAL)
+/*
+ * Search filtering (-s): restrict actionable hubs to the one with an
+ * attached device whose description matches opt_search, and restrict
+ * opt_ports to its port. Candidate (hub, port, device) tuples are
+ * collected from the topology index first with no I/O at all, then
+ * descriptions are resolved lazily: devices already in the description
+ * cache are checked for free before any descriptor is fetched over the
+ * wire, fetching stops at the first match instead of walking every
+ * remaining hub's children, and whatever was fetched stays cached for
+ * the status printer.
+ */
+
+static void search_filter_hubs(void)
+{
+    struct search_candidate {
+        struct hub_info *hub;
+        struct libusb_device *udev;
+        int port;
+        int done;
+    };
+    struct hub_info *match_hub = NULL;
+    int match_port = 0;
+    int ncands = 0;
+    int i, port, pass;
+
+    struct search_candidate *cands = calloc(
+        hub_count ? hub_count * MAX_HUB_PORTS : 1, sizeof(*cands));
+    if (cands == NULL) {
+        return;
+    }
+    for (i=0; i<hub_count; i++) {
+        struct hub_info *hub = &hubs[i];
+        if (!hub->actionable)
+            continue;
+        for (port=1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+            struct libusb_device *udev =
+                topo_find_child(hub->bus, hub->port_numbers, hub->pn_len, port);
+            if (udev == NULL)
+                continue;
+            cands[ncands].hub = hub;
+            cands[ncands].udev = udev;
+            cands[ncands].port = port;
+            ncands++;
+        }
+    }
+    /* Pass 0 costs no I/O (description cache hits only), pass 1 fetches
+     * the rest; both passes end at the first match: */
+    for (pass=0; pass<2 && match_hub == NULL; pass++) {
+        for (i=0; i<ncands; i++) {
+            struct search_candidate *cand = &cands[i];
+            struct descriptor_strings ds;
+            if (cand->done)
+                continue;
+            bzero(&ds, sizeof(ds));
+            if (pass == 0) {
+                if (!desc_cache_peek(cand->udev, &ds))
+                    continue;
+            } else {
+                if (get_device_description(cand->udev, &ds) != 0)
+                    continue;
+            }
+            cand->done = 1;
+            if (strstr(ds.description, opt_search)) {
+                match_hub = cand->hub;
+                match_port = cand->port;
+                break;
+            }
+        }
+    }
+    free(cands);
+    for (i=0; i<hub_count; i++) {
+        if (hubs[i].actionable) {
+            hubs[i].actionable = (&hubs[i] == match_hub);
+        }
+    }
+    if (match_hub) {
+        opt_ports &= 1 << (match_port - 1);
+    }
+}
+#endif /* !UHUBCTL_MINIMAL */
+
+
+/*
+ *  Find all USB hubs and fill hubs[] array.
  *  Set actionable to 1 on all hubs that we are going to operate on
  *  (this applies possible constraints like location or vendor).
  *  Returns count of found actionable physical hubs
@@ -892,316 +3373,1773 @@ static int print_port_status(struct hub_info * hub, int portmask)
  *  In case of error returns negative error code.
  */
 
-static int usb_find_hubs(void)
-{
-    struct libusb_device *dev;
-    int perm_ok = 1;
-    int rc = 0;
-    int i = 0;
-    int j = 0;
-    while ((dev = usb_devs[i++]) != NULL) {
-        struct libusb_device_descriptor desc;
-        rc = libusb_get_device_descriptor(dev, &desc);
-        /* only scan for hubs: */
-        if (rc == 0 && desc.bDeviceClass != LIBUSB_CLASS_HUB)
+static int usb_find_hubs(void)
+{
+    struct libusb_device *dev;
+    int perm_ok = 1;
+    int rc = 0;
+    int i = 0;
+    int ndevs = 0;
+    int ntasks = 0;
+    int nprobe = 0;
+    int nunprobed = 0;
+
+    /* With an exact location we can skip probing hubs that can be neither
+     * the target nor its USB2/3 dual counterpart:
+     */
+    int direct_target = 0;
+    uint8_t target_bus = 0;
+    uint8_t target_pn[MAX_HUB_CHAIN];
+    int target_len = 0;
+    if (strlen(opt_location) > 0 && strlen(opt_search) == 0) {
+        direct_target =
+            parse_location(opt_location, &target_bus, target_pn, &target_len) == 0;
+    }
+
+    /* Collect all hub-class candidate devices first: */
+    while (usb_devs[ndevs] != NULL) {
+        ndevs++;
+    }
+    struct scan_task *tasks = calloc(ndevs ? ndevs : 1, sizeof(*tasks));
+    if (tasks == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    while ((dev = usb_devs[i++]) != NULL) {
+        struct scan_task *task = &tasks[ntasks];
+        rc = libusb_get_device_descriptor(dev, &task->desc);
+        /* only scan for hubs: */
+        if (rc == 0 && task->desc.bDeviceClass != LIBUSB_CLASS_HUB)
+            continue;
+        if (direct_target) {
+            uint8_t pn[MAX_HUB_CHAIN];
+            uint8_t bus = libusb_get_bus_number(dev);
+            int pn_len = get_port_numbers(dev, pn, sizeof(pn));
+            int match = bus == target_bus && pn_len == target_len &&
+                        memcmp(pn, target_pn, target_len) == 0;
+            if (!match) {
+                if (opt_exact)
+                    continue;
+                /* The dual sits at the same tree depth, or one level away
+                 * (top-level hubs on some Macs, port shift on RPi 4B):
+                 */
+                if (pn_len < target_len - 1 || pn_len > target_len + 1)
+                    continue;
+            }
+        }
+        task->dev = dev;
+        task->desc_ok = (rc == 0);
+        if (task->desc_ok && strlen(opt_cache) > 0) {
+            struct hub_cache_entry *cached = hub_cache_find(dev, &task->desc);
+            if (cached) {
+                /* Warm start: no control transfers needed for this hub */
+                memcpy(&task->info, &cached->info, sizeof(task->info));
+                task->info.dev = dev;
+                task->cached = 1;
+            }
+        }
+        if (!task->cached) {
+            nprobe++;
+        }
+        ntasks++;
+    }
+
+    /* Probe all uncached hubs, concurrently where possible: */
+    scan_probe_tasks(tasks, ntasks, nprobe);
+
+    /* Merge probe results, preserving stable device list order: */
+    for (i=0; i<ntasks; i++) {
+        struct scan_task *task = &tasks[i];
+        if (!task->cached) {
+            if (task->unprobed) {
+                nunprobed++;
+                continue;
+            }
+            if (task->rc) {
+                perm_ok = 0; /* USB permission issue? */
+                continue;
+            }
+            if (strlen(opt_cache) > 0 && !opt_nodesc && task->desc_ok) {
+                hub_cache_add(&task->desc, &task->info);
+            }
+        }
+        if (task->info.lpsm != HUB_CHAR_INDV_PORT_LPSM && !opt_force) {
+            continue;
+        }
+        struct hub_info *info = hub_new();
+        if (info == NULL) {
+            free(tasks);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        memcpy(info, &task->info, sizeof(*info));
+        info->actionable = 1;
+        apply_hub_filters(info);
+    }
+    free(tasks);
+    if (nunprobed > 0) {
+        fprintf(stderr, "%d hub(s) unprobed within scan budget of %d ms, skipped\n",
+            nunprobed, opt_scan_budget);
+    }
+#if !defined(UHUBCTL_MINIMAL)
+    if (strlen(opt_search) > 0) {
+        /* Search by attached device description, lazily (see above): */
+        search_filter_hubs();
+    }
+#endif
+    usb_match_duals_and_count();
+    if (perm_ok == 0 && hub_phys_count == 0) {
+#if defined(__gnu_linux__) || defined(__linux__)
+        if (geteuid() != 0) {
+            fprintf(stderr,
+                "There were permission problems while accessing USB.\n"
+                "Follow https://git.io/JIB2Z for a fix!\n"
+            );
+        }
+#endif
+        return LIBUSB_ERROR_ACCESS;
+    }
+    return hub_phys_count;
+}
+
+
+/*
+ * Reset all options to their defaults.
+ * Used by daemon mode to give every command a clean slate.
+ */
+
+static void reset_options(void)
+{
+    opt_vendor[0] = 0;
+    opt_search[0] = 0;
+    opt_location[0] = 0;
+    opt_level = 0;
+    opt_ports = ALL_HUB_PORTS;
+    opt_action = POWER_KEEP;
+    opt_delay = 2;
+    opt_repeat = 1;
+    opt_wait = 20;
+    opt_at_deadline = 0;
+    opt_scan_budget = 0;
+    opt_exact = 0;
+    opt_multi = 0;
+    opt_watch = 0;
+    opt_reset = 0;
+    opt_force = 0;
+    opt_nodesc = 0;
+    opt_format = FORMAT_TEXT;
+#if defined(__gnu_linux__) || defined(__linux__)
+    opt_nosysfs = 0;
+#endif
+}
+
+
+/*
+ * Parse command line options.
+ * Returns 0 on success, 1 if version was requested,
+ * 2 if help was requested and -1 if options were not valid.
+ */
+
+static int parse_options(int argc, char *argv[])
+{
+    int c = 0;
+    int option_index = 0;
+
+    for (;;) {
+        c = getopt_long(argc, argv, short_options, long_options, &option_index);
+        if (c == -1)
+            break;  /* no more options left */
+        switch (c) {
+        case 0:
+            /* If this option set a flag, do nothing else now. */
+            if (long_options[option_index].flag != 0)
+                break;
+            printf("option %s", long_options[option_index].name);
+            if (optarg)
+                printf(" with arg %s", optarg);
+            printf("\n");
+            break;
+        case 'l':
+            snprintf(opt_location, sizeof(opt_location), "%s", optarg);
+            break;
+        case 'L':
+            opt_level = atoi(optarg);
+            break;
+        case 'n':
+            snprintf(opt_vendor, sizeof(opt_vendor), "%s", optarg);
+            break;
+#if !defined(UHUBCTL_MINIMAL)
+        case 's':
+            snprintf(opt_search, sizeof(opt_search), "%s", optarg);
+            break;
+#endif
+        case 'C':
+            snprintf(opt_cache, sizeof(opt_cache), "%s", optarg);
+            break;
+        case 'p':
+            if (!strcasecmp(optarg, "all")) { /* all ports is the default */
+                break;
+            }
+            if (strlen(optarg)) {
+                int ports = ports2bitmap(optarg);
+                if (ports < 0) {
+                    return -1;
+                }
+                opt_ports = ports;
+            }
+            break;
+        case 'a': {
+            int action = parse_power_action(optarg);
+            if (action != -2) {
+                opt_action = action;
+            }
+            break;
+        }
+        case 'b':
+            snprintf(opt_batch, sizeof(opt_batch), "%s", optarg);
+            break;
+        case 1001:
+            snprintf(opt_record, sizeof(opt_record), "%s", optarg);
+            break;
+        case 1002:
+            snprintf(opt_bench, sizeof(opt_bench), "%s", optarg);
+            break;
+        case 1004:
+            /* Anchor the deadline at parse time, so enumeration overhead
+             * does not delay the scheduled action edge: */
+            opt_at_deadline = get_time_us() + (int64_t)atoi(optarg) * 1000;
+            break;
+        case 1005:
+            opt_scan_budget = atoi(optarg);
+            break;
+        case 'o':
+            if (!strcasecmp(optarg, "text")) {
+                opt_format = FORMAT_TEXT;
+            } else if (!strcasecmp(optarg, "json")) {
+                opt_format = FORMAT_JSON;
+            } else if (!strcasecmp(optarg, "tsv")) {
+                opt_format = FORMAT_TSV;
+            } else {
+                fprintf(stderr, "Unknown output format %s!\n", optarg);
+                return -1;
+            }
+            break;
+        case 'd':
+            opt_delay = atof(optarg);
+            break;
+        case 'r':
+            opt_repeat = atoi(optarg);
+            break;
+        case 'f':
+            opt_force = 1;
+            break;
+        case 'm':
+            opt_multi = 1;
+            break;
+        case 'W':
+            opt_watch = 1;
+            break;
+        case 'N':
+            opt_nodesc = 1;
+            break;
+#if defined(__gnu_linux__) || defined(__linux__)
+        case 'S':
+            opt_nosysfs = 1;
+            break;
+#endif
+#if !defined(_WIN32)
+        case 'D':
+            snprintf(opt_daemon, sizeof(opt_daemon), "%s", optarg);
+            break;
+        case 1003:
+            snprintf(opt_export, sizeof(opt_export), "%s", optarg);
+            break;
+#endif
+        case 'e':
+            opt_exact = 1;
+            break;
+        case 'R':
+            opt_reset = 1;
+            break;
+        case 'w':
+            opt_wait = atoi(optarg);
+            break;
+        case 'v':
+            printf("%s\n", PROGRAM_VERSION);
+            return 1;
+        case 'h':
+            print_usage();
+            return 2;
+        case '?':
+            /* getopt_long has already printed an error message here */
+            fprintf(stderr, "Run with -h to get usage info.\n");
+            return -1;
+        default:
+            abort();
+        }
+    }
+    if (optind < argc) {
+        /* non-option parameters are found? */
+        fprintf(stderr, "Invalid command line syntax!\n");
+        fprintf(stderr, "Run with -h to get usage info.\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Refresh usb_devs[] and rebuild hubs[] array from scratch.
+ * Returns hub_phys_count or negative error code.
+ */
+
+static int rescan_hubs(void)
+{
+    int rc;
+    /* Arm the discovery deadline covering enumeration and all probes: */
+    scan_deadline_us = opt_scan_budget > 0 ?
+        get_time_us() + (int64_t)opt_scan_budget * 1000 : 0;
+    if (usb_devs) {
+#if !defined(UHUBCTL_MINIMAL)
+        desc_cache_clear();
+#endif
+        topo_index_clear();
+#if defined(__gnu_linux__) || defined(__linux__)
+        sysfs_cache_clear();
+#endif
+        libusb_free_device_list(usb_devs, 1);
+        usb_devs = NULL;
+    }
+    hub_count = 0;
+    hub_phys_count = 0;
+    int64_t pt = prof_start();
+    rc = libusb_get_device_list(NULL, &usb_devs);
+    prof_end(PROF_DEVICE_LIST, pt);
+    if (rc < 0) {
+        fprintf(stderr,
+            "Cannot enumerate USB devices!\n"
+        );
+        scan_deadline_us = 0;
+        return rc;
+    }
+    rc = usb_find_hubs();
+    /* Disarm so later transfers (status reads, actions) are not clamped: */
+    scan_deadline_us = 0;
+    return rc;
+}
+
+
+/*
+ * Recompute actionable flags on already discovered hubs[] without any USB I/O.
+ * Only valid when opt_search is not used - search needs attached
+ * device descriptions and therefore a full rescan.
+ */
+
+static void refilter_hubs(void)
+{
+    int i;
+    for (i=0; i<hub_count; i++) {
+        hubs[i].actionable = 1;
+        apply_hub_filters(&hubs[i]);
+    }
+    usb_match_duals_and_count();
+}
+
+
+/*
+ * Perform requested action on all actionable hubs.
+ * Returns 0 on success and error code otherwise.
+ */
+
+/* True if hub a sits upstream of hub b, i.e. b hangs off one of a's
+ * ports, possibly through more hubs in between. Cutting power on a's
+ * port would take b down, so their actions must not overlap: */
+static int hub_is_ancestor(struct hub_info *a, struct hub_info *b)
+{
+    if (a == b || a->bus != b->bus || a->pn_len >= b->pn_len) {
+        return 0;
+    }
+    return memcmp(a->port_numbers, b->port_numbers, a->pn_len) == 0;
+}
+
+/* One hub power action (used for concurrent multi-hub operation).
+ * Action parameters are carried here rather than read from opt_*
+ * globals, so actions with different parameters (batch mode) can
+ * run concurrently:
+ */
+struct hub_action {
+    struct hub_info *hub;
+    int k;            /* 0 for power OFF, 1 for power ON */
+    int rc;
+    int should_be_on; /* final request direction, for reporting */
+    int ports;        /* bitmask of ports to operate on */
+    int action;       /* POWER_* requested */
+    double delay;     /* cycle/flash delay in seconds */
+};
+
+/*
+ * Execute power action on all selected ports of one hub:
+ * open the hub, flip ports that are not already in the desired state
+ * and wait for the ports to settle. Safe to run concurrently for
+ * different hubs - all output is left to the caller.
+ */
+
+static int hub_do_power(struct hub_action *act)
+{
+    struct hub_info *hub = act->hub;
+    int k = act->k;
+    struct libusb_device_handle * devh = NULL;
+    int rc = libusb_open(hub->dev, &devh);
+    if (rc != 0) {
+        return rc;
+    }
+    /* will operate on these ports */
+    int ports = ((1 << hub->nports) - 1) & act->ports;
+    int should_be_on = k;
+    if (act->action == POWER_FLASH) {
+        should_be_on = !should_be_on;
+    }
+
+    /* Read all selected port states in one batch and sort ports that
+     * need flipping by direction (toggle can need both): */
+    int port;
+    int status[MAX_HUB_PORTS+1];
+    int power_mask = hub->super_speed ? USB_SS_PORT_STAT_POWER
+                                      : USB_PORT_STAT_POWER;
+    int mask_on = 0;
+    int mask_off = 0;
+    get_ports_status(devh, hub, ports, status);
+    for (port=1; port <= hub->nports; port++) {
+        if (((1 << (port-1)) & ports) == 0) continue;
+        int port_status = port <= MAX_HUB_PORTS ? status[port]
+                                                : get_port_status(devh, port);
+        int is_on = (port_status & power_mask) != 0;
+
+        if (act->action == POWER_TOGGLE) {
+            should_be_on = !is_on;
+        }
+
+        if (is_on != should_be_on) {
+            if (should_be_on) {
+                mask_on |= 1 << (port-1);
+            } else {
+                mask_off |= 1 << (port-1);
+            }
+        }
+    }
+
+    int want;
+    for (want=0; want<2; want++) {
+        int dmask = want ? mask_on : mask_off;
+        int mask = dmask;
+        if (dmask == 0) continue;
+#if defined(__gnu_linux__) || defined(__linux__)
+        if (!opt_nosysfs) {
+            /* sysfs writes are cheap, no point batching those: */
+            for (port=1; port <= hub->nports; port++) {
+                if ((mask & (1 << (port-1))) &&
+                    set_port_status_linux(devh, hub, port, want) == 0)
+                {
+                    mask &= ~(1 << (port-1));
+                }
+            }
+        }
+#endif
+        /* Switch the remaining ports as one pipelined async batch: */
+        int done = mask ? set_ports_status_libusb(devh, hub, mask, want) : 0;
+        int retry = mask & ~done;
+        if (dmask & ~retry) {
+            /* Verify the batch took effect - some hubs need the command
+             * repeated, which the per-port path below handles: */
+            get_ports_status(devh, hub, dmask & ~retry, status);
+            for (port=1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+                if (((dmask & ~retry) & (1 << (port-1))) == 0) continue;
+                int is_on = (status[port] & power_mask) != 0;
+                if (is_on != want) {
+                    retry |= 1 << (port-1);
+                }
+            }
+        }
+        for (port=1; port <= hub->nports; port++) {
+            if (retry & (1 << (port-1))) {
+                rc = set_port_status(devh, hub, port, want);
+            }
+        }
+    }
+    int64_t pt = prof_start();
+    if (k==0 && act->action == POWER_CYCLE) {
+        /* Instead of sleeping fixed delay, verify that ports
+         * actually reached off state, with the delay as upper bound: */
+        wait_ports_off(devh, hub, ports, (int)(act->delay * 1000));
+        prof_end(PROF_SETTLE, pt);
+    } else if (k==0 && hub->super_speed) {
+        /* USB3 hubs need extra delay to actually turn off - use the
+         * measured settle time of this model when we have one: */
+        sleep_ms(settle_seed_ms(hub, 150));
+        prof_end(PROF_SETTLE, pt);
+    }
+    libusb_close(devh);
+    act->should_be_on = should_be_on;
+    return rc < 0 ? rc : 0;
+}
+
+
+#if !defined(_WIN32)
+static void* hub_action_worker(void *arg)
+{
+    struct hub_action *act = arg;
+    act->rc = hub_do_power(act);
+    return NULL;
+}
+#endif
+
+
+static int run_action(void)
+{
+    int rc = 0;
+    if (hub_phys_count > 1 && opt_action >= 0 && !opt_multi) {
+        fprintf(stderr,
+            "Error: changing port state for multiple hubs at once is not supported.\n"
+            "Use -l to limit operation to one hub, or -m to allow multiple hubs!\n"
+        );
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (opt_at_deadline && opt_action != POWER_KEEP) {
+        sleep_until_us(opt_at_deadline);
+        opt_at_deadline = 0;
+    }
+    int k; /* k=0 for power OFF, k=1 for power ON */
+    for (k=0; k<2; k++) { /* up to 2 power actions - off/on */
+        if (k == 0 && opt_action == POWER_ON )
+            continue;
+        if (k == 1 && opt_action == POWER_OFF)
+            continue;
+        if (k == 1 && opt_action == POWER_KEEP)
+            continue;
+        /* if toggle requested, do it only once when `k == 0` */
+        if (k == 1 && opt_action == POWER_TOGGLE)
+            continue;
+        int i;
+        struct hub_action *actions = calloc(hub_count ? hub_count : 1, sizeof(*actions));
+        int nactions = 0;
+        if (actions == NULL) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+
+        /* Show current status and collect hubs to act on: */
+        for (i=0; i<hub_count; i++) {
+            if (hubs[i].actionable == 0)
+                continue;
+            if (opt_format == FORMAT_TEXT) {
+                printf("Current status for hub %s [%s]\n",
+                    hubs[i].location, hub_description(&hubs[i])
+                );
+            }
+            print_port_status(&hubs[i], opt_ports);
+            if (opt_action == POWER_KEEP) { /* no action, show status */
+                continue;
+            }
+            actions[nactions].hub = &hubs[i];
+            actions[nactions].k = k;
+            actions[nactions].rc = 0;
+            actions[nactions].should_be_on = k;
+            actions[nactions].ports = opt_ports;
+            actions[nactions].action = opt_action;
+            actions[nactions].delay = opt_delay;
+            nactions++;
+        }
+
+        /* Flip the ports - concurrently across hubs when -m is given,
+         * so total wall time is that of the slowest hub. Hubs nested
+         * behind another selected hub are scheduled in dependency
+         * waves (wave = number of selected ancestors), since cutting
+         * power on a parent port while a child hub is mid-action
+         * aborts the child's transfers. Independent subtrees still
+         * run fully in parallel, so a whole rack costs tree depth
+         * rather than hub count times per-hub latency. The off pass
+         * walks leaves up, the on pass walks roots down: */
+        int concurrent = 0;
+#if !defined(_WIN32)
+        if (opt_multi && nactions > 1) {
+            pthread_t *threads = calloc(nactions, sizeof(*threads));
+            int *wave = calloc(nactions, sizeof(*wave));
+            char *started = calloc(nactions, sizeof(*started));
+            if (threads != NULL && wave != NULL && started != NULL) {
+                int j;
+                int max_wave = 0;
+                for (i=0; i<nactions; i++) {
+                    for (j=0; j<nactions; j++) {
+                        if (hub_is_ancestor(actions[j].hub, actions[i].hub)) {
+                            wave[i]++;
+                        }
+                    }
+                    if (wave[i] > max_wave) {
+                        max_wave = wave[i];
+                    }
+                }
+                int w;
+                for (w=0; w<=max_wave; w++) {
+                    int depth = k ? w : max_wave - w;
+                    for (i=0; i<nactions; i++) {
+                        if (wave[i] != depth) continue;
+                        started[i] = pthread_create(&threads[i], NULL,
+                            hub_action_worker, &actions[i]) == 0;
+                        if (!started[i]) {
+                            /* Thread did not start - run inline, still in order: */
+                            actions[i].rc = hub_do_power(&actions[i]);
+                        }
+                    }
+                    for (i=0; i<nactions; i++) {
+                        if (wave[i] == depth && started[i]) {
+                            pthread_join(threads[i], NULL);
+                        }
+                    }
+                }
+                concurrent = 1;
+            }
+            free(threads);
+            free(wave);
+            free(started);
+        }
+#endif
+        if (!concurrent) {
+            for (i=0; i<nactions; i++) {
+                actions[i].rc = hub_do_power(&actions[i]);
+            }
+        }
+        /* Flash pulse width is measured from the off edge, so status
+         * reporting below does not eat into it: */
+        int64_t flash_edge = get_time_us();
+
+        /* Report new status: */
+        for (i=0; i<nactions; i++) {
+            struct hub_action *act = &actions[i];
+            if (act->rc != 0) {
+                rc = act->rc;
+                continue;
+            }
+            if (opt_format == FORMAT_TEXT) {
+                printf("Sent power %s request\n", act->should_be_on ? "on" : "off");
+                printf("New status for hub %s [%s]\n",
+                    act->hub->location, hub_description(act->hub)
+                );
+            }
+            print_port_status(act->hub, opt_ports);
+
+            if (k == 1 && opt_reset == 1) {
+                struct libusb_device_handle * devh = NULL;
+                printf("Resetting hub...\n");
+                if (libusb_open(act->hub->dev, &devh) == 0) {
+                    if (libusb_reset_device(devh) < 0) {
+                        perror("Reset failed!\n");
+                    } else {
+                        printf("Reset successful!\n");
+                    }
+                    libusb_close(devh);
+                } else {
+                    perror("Reset failed!\n");
+                }
+            }
+        }
+        free(actions);
+        /* Power cycle completion is verified per hub above, flash keeps its
+         * fixed pulse duration (absolute deadline, so jitter is bounded): */
+        if (k == 0 && opt_action == POWER_FLASH) {
+            int64_t pt = prof_start();
+            sleep_until_us(flash_edge + (int64_t)(opt_delay * 1000000));
+            prof_end(PROF_SETTLE, pt);
+        }
+    }
+    return rc < 0 ? rc : 0;
+}
+
+
+/*
+ * Batch mode (-b): read action lines from a file (or stdin) and run
+ * them all against a single enumeration pass. Line format is
+ *     location ports action [delay]
+ * e.g. `1-2.3 1-4 off` or `2-1 all cycle 5`. Blank lines and lines
+ * starting with # are skipped. Lines are validated and resolved
+ * before any port is touched, then lines targeting different hubs
+ * run concurrently.
+ */
+
+#define MAX_BATCH_LINES 256
+
+struct batch_line {
+    char location[32];
+    int ports;
+    int action;
+    double delay;
+    struct hub_info *hub;
+    struct hub_info *dual; /* USB2/3 dual of hub, or NULL */
+    int rc;
+    int should_be_on;
+};
+
+/*
+ * Execute one batch line: both power passes (off then on for cycle
+ * and flash), serially within the line. Does not print anything,
+ * safe to run concurrently for different hubs.
+ */
+
+static void* batch_line_worker(void *arg)
+{
+    struct batch_line *bl = arg;
+    int k;
+    if (bl->action == POWER_KEEP) { /* no action, status only */
+        return NULL;
+    }
+    for (k=0; k<2; k++) {
+        if (k == 0 && bl->action == POWER_ON)
+            continue;
+        if (k == 1 && (bl->action == POWER_OFF || bl->action == POWER_TOGGLE))
+            continue;
+        struct hub_action act;
+        act.hub = bl->hub;
+        act.k = k;
+        act.rc = 0;
+        act.should_be_on = k;
+        act.ports = bl->ports;
+        act.action = bl->action;
+        act.delay = bl->delay;
+        bl->rc = hub_do_power(&act);
+        bl->should_be_on = act.should_be_on;
+#if !defined(UHUBCTL_MINIMAL)
+        /* The USB2/3 dual is the same physical hub - switch it too,
+         * like the regular option path does for actionable==2 hubs: */
+        if (bl->dual != NULL) {
+            struct hub_action dual_act = act;
+            dual_act.hub = bl->dual;
+            dual_act.rc = 0;
+            dual_act.should_be_on = k;
+            int dual_rc = hub_do_power(&dual_act);
+            if (bl->rc == 0) {
+                bl->rc = dual_rc;
+            }
+        }
+#endif
+        int64_t flash_edge = get_time_us();
+        if (bl->rc != 0)
+            break;
+        if (k == 0 && bl->action == POWER_FLASH)
+            sleep_until_us(flash_edge + (int64_t)(bl->delay * 1000000));
+    }
+    return NULL;
+}
+
+
+static int batch_loop(void)
+{
+    static struct batch_line lines[MAX_BATCH_LINES];
+    char buf[256];
+    int nlines = 0;
+    int lineno = 0;
+    int rc = 0;
+    int i;
+
+    FILE *f = strcmp(opt_batch, "-") == 0 ? stdin : fopen(opt_batch, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open batch file %s!\n", opt_batch);
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        lineno++;
+        char *location = strtok(buf, " \t\r\n");
+        if (location == NULL || location[0] == '#')
+            continue;
+        if (nlines >= MAX_BATCH_LINES) {
+            fprintf(stderr, "Too many batch lines, max is %d!\n", MAX_BATCH_LINES);
+            rc = -1;
+            break;
+        }
+        struct batch_line *bl = &lines[nlines];
+        memset(bl, 0, sizeof(*bl));
+        snprintf(bl->location, sizeof(bl->location), "%s", location);
+        char *ports  = strtok(NULL, " \t\r\n");
+        char *action = strtok(NULL, " \t\r\n");
+        char *delay  = strtok(NULL, " \t\r\n");
+        bl->ports = ALL_HUB_PORTS;
+        if (ports && strcasecmp(ports, "all")) {
+            bl->ports = ports2bitmap(ports);
+        }
+        bl->action = action ? parse_power_action(action) : -2;
+        bl->delay = delay ? atof(delay) : opt_delay;
+        if (ports == NULL || action == NULL || bl->ports < 0 || bl->action == -2) {
+            fprintf(stderr, "Invalid batch line %d!\n", lineno);
+            rc = -1;
+            break;
+        }
+        nlines++;
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (rc < 0 || nlines == 0) {
+        return rc;
+    }
+
+    rc = rescan_hubs();
+    if (rc <= 0) {
+        fprintf(stderr, "No compatible smart hubs detected!\n");
+        return rc < 0 ? rc : -1;
+    }
+
+    /* Resolve every line against discovered hubs before acting on any: */
+    int dup = 0;
+    for (i=0; i<nlines; i++) {
+        int h;
+        for (h=0; h<hub_count; h++) {
+            if (strcasecmp(hubs[h].location, lines[i].location) == 0) {
+                lines[i].hub = &hubs[h];
+                break;
+            }
+        }
+        if (lines[i].hub == NULL) {
+            fprintf(stderr, "No smart hub found at location %s!\n", lines[i].location);
+            return -1;
+        }
+#if !defined(UHUBCTL_MINIMAL)
+        /* A line names one half of a USB2/3 pair but means the whole
+         * physical hub, so the action must cover the dual as well: */
+        lines[i].dual = hub_find_dual(lines[i].hub);
+#endif
+        for (h=0; h<i; h++) {
+            /* Lines naming either half of the same pair are the same
+             * physical hub - order matters, run serially: */
+            if (lines[h].hub == lines[i].hub ||
+                lines[h].hub == lines[i].dual ||
+                (lines[h].dual != NULL &&
+                 (lines[h].dual == lines[i].hub || lines[h].dual == lines[i].dual)))
+            {
+                dup = 1;
+            }
+        }
+    }
+
+    /* Show current status: */
+    for (i=0; i<nlines; i++) {
+        if (opt_format == FORMAT_TEXT) {
+            printf("Current status for hub %s [%s]\n",
+                lines[i].hub->location, hub_description(lines[i].hub)
+            );
+        }
+        print_port_status(lines[i].hub, lines[i].ports);
+        if (lines[i].dual != NULL) {
+            if (opt_format == FORMAT_TEXT) {
+                printf("Current status for hub %s [%s]\n",
+                    lines[i].dual->location, hub_description(lines[i].dual)
+                );
+            }
+            print_port_status(lines[i].dual, lines[i].ports);
+        }
+    }
+
+    /* Flip the ports, concurrently across hubs where safe. Lines whose
+     * hub sits behind another line's hub run in earlier waves (children
+     * before the hub feeding them), so a parent cycling its ports never
+     * cuts power under a child hub mid-action, while lines in
+     * independent subtrees still run in parallel: */
+    int concurrent = 0;
+#if !defined(_WIN32)
+    if (nlines > 1 && !dup) {
+        pthread_t threads[MAX_BATCH_LINES];
+        char started[MAX_BATCH_LINES];
+        int wave[MAX_BATCH_LINES];
+        int j;
+        int max_wave = 0;
+        for (i=0; i<nlines; i++) {
+            wave[i] = 0;
+            for (j=0; j<nlines; j++) {
+                /* Either half of a USB2/3 pair feeds the same downstream
+                 * devices, so duals count for the ancestor relation too: */
+                if (hub_is_ancestor(lines[j].hub, lines[i].hub) ||
+                    (lines[j].dual != NULL &&
+                     hub_is_ancestor(lines[j].dual, lines[i].hub)) ||
+                    (lines[i].dual != NULL &&
+                     hub_is_ancestor(lines[j].hub, lines[i].dual)) ||
+                    (lines[j].dual != NULL && lines[i].dual != NULL &&
+                     hub_is_ancestor(lines[j].dual, lines[i].dual)))
+                {
+                    wave[i]++;
+                }
+            }
+            if (wave[i] > max_wave) {
+                max_wave = wave[i];
+            }
+        }
+        int w;
+        for (w=max_wave; w>=0; w--) {
+            for (i=0; i<nlines; i++) {
+                if (wave[i] != w) continue;
+                started[i] = pthread_create(&threads[i], NULL,
+                    batch_line_worker, &lines[i]) == 0;
+                if (!started[i]) {
+                    /* Thread did not start - run inline, still in order: */
+                    batch_line_worker(&lines[i]);
+                }
+            }
+            for (i=0; i<nlines; i++) {
+                if (wave[i] == w && started[i]) {
+                    pthread_join(threads[i], NULL);
+                }
+            }
+        }
+        concurrent = 1;
+    }
+#endif
+    if (!concurrent) {
+        for (i=0; i<nlines; i++) {
+            batch_line_worker(&lines[i]);
+        }
+    }
+
+    /* Report new status: */
+    rc = 0;
+    for (i=0; i<nlines; i++) {
+        struct batch_line *bl = &lines[i];
+        if (bl->rc != 0) {
+            rc = bl->rc;
             continue;
-        struct hub_info info;
-        bzero(&info, sizeof(info));
-        rc = get_hub_info(dev, &info);
-        if (rc) {
-            perm_ok = 0; /* USB permission issue? */
+        }
+        if (bl->action == POWER_KEEP)
             continue;
+        if (opt_format == FORMAT_TEXT) {
+            printf("Sent power %s request\n", bl->should_be_on ? "on" : "off");
+            printf("New status for hub %s [%s]\n",
+                bl->hub->location, hub_description(bl->hub)
+            );
+        }
+        print_port_status(bl->hub, bl->ports);
+        if (bl->dual != NULL) {
+            if (opt_format == FORMAT_TEXT) {
+                printf("New status for hub %s [%s]\n",
+                    bl->dual->location, hub_description(bl->dual)
+                );
+            }
+            print_port_status(bl->dual, bl->ports);
+        }
+    }
+    return rc < 0 ? rc : 0;
+}
+
+
+/*
+ * Topology record/replay benchmark (--record / --bench).
+ *
+ * --record FILE captures the discovered hubs[] array after a scan, so
+ * large real topologies can be replayed later without the hardware.
+ * --bench takes either such a file or a number of synthetic hubs and
+ * measures dual-matching and status-formatting throughput, the phases
+ * that scale with topology size and need no USB I/O.
+ */
+
+#define HUB_RECORD_MAGIC   0x52424855 /* "UHBR" */
+#define HUB_RECORD_VERSION 1
+
+static int record_hubs(const char *path)
+{
+    int i;
+    int ok = 1;
+    char tmp_path[1040];
+    struct hub_cache_header hdr;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    hdr.magic = HUB_RECORD_MAGIC;
+    hdr.version = HUB_RECORD_VERSION;
+    hdr.entry_size = sizeof(struct hub_info);
+    hdr.count = hub_count;
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (i=0; ok && i<hub_count; i++) {
+        struct hub_info rec;
+        memcpy(&rec, &hubs[i], sizeof(rec));
+        rec.dev = NULL; /* pointers are meaningless on disk */
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+    }
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return rename(tmp_path, path);
+}
+
+
+static int load_recorded_hubs(const char *path, struct hub_info **out)
+{
+    struct hub_cache_header hdr;
+    int count = 0;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        hdr.magic != HUB_RECORD_MAGIC ||
+        hdr.version != HUB_RECORD_VERSION ||
+        hdr.entry_size != sizeof(struct hub_info) ||
+        hdr.count > 65536)
+    {
+        fclose(f);
+        return -1;
+    }
+    *out = calloc(hdr.count ? hdr.count : 1, sizeof(**out));
+    if (*out == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (count < (int)hdr.count &&
+           fread(&(*out)[count], sizeof(**out), 1, f) == 1)
+    {
+        (*out)[count].dev = NULL;
+        sanitize_hub_info(&(*out)[count]);
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+
+/*
+ * Synthesize one USB2/USB3 dual hub pair the way Linux usually
+ * arranges them: same port path, usb3 bus right after usb2 bus,
+ * matching container IDs.
+ */
+
+static void bench_synth_pair(struct hub_info *usb2, struct hub_info *usb3, int index)
+{
+    bzero(usb2, sizeof(*usb2));
+    usb2->bcd_usb = 0x0210;
+    usb2->super_speed = 0;
+    usb2->nports = 4;
+    usb2->lpsm = HUB_CHAR_INDV_PORT_LPSM;
+    usb2->actionable = 1;
+#if !defined(UHUBCTL_MINIMAL)
+    int k;
+    uint32_t hash = 2166136261u ^ index;
+    usb2->has_container_id = 1;
+    for (k=0; k<16; k++) {
+        hash = (hash ^ k) * 16777619u;
+        usb2->container_id[k] = hash & 0xff;
+    }
+#endif
+    usb2->bus = 1;
+    usb2->port_numbers[0] = (index % 250) + 1;
+    usb2->pn_len = 1;
+    snprintf(usb2->vendor, sizeof(usb2->vendor), "2109:2817");
+#if !defined(UHUBCTL_MINIMAL)
+    snprintf(usb2->ds.description, sizeof(usb2->ds.description),
+        "Bench hub %d", index);
+#endif
+
+    memcpy(usb3, usb2, sizeof(*usb3));
+    usb3->bcd_usb = 0x0310;
+    usb3->super_speed = 1;
+    usb3->bus = 2;
+    snprintf(usb3->vendor, sizeof(usb3->vendor), "2109:0817");
+}
+
+
+static int bench_loop(void)
+{
+    struct hub_info *tmpl = NULL;
+    int tmpl_count = 0;
+    int64_t t0, elapsed;
+    int iters;
+    int i;
+
+    if (opt_bench[0] >= '0' && opt_bench[0] <= '9') {
+        int want = atoi(opt_bench);
+        if (want < 2) {
+            want = 2;
+        }
+        tmpl = calloc(want, sizeof(*tmpl));
+        if (tmpl == NULL) {
+            return -1;
+        }
+        for (i=0; i+1 < want; i+=2) {
+            bench_synth_pair(&tmpl[i], &tmpl[i+1], i/2);
         }
-        get_device_description(dev, &info.ds);
-        if (info.lpsm != HUB_CHAR_INDV_PORT_LPSM && !opt_force) {
+        tmpl_count = i;
+    } else {
+        tmpl_count = load_recorded_hubs(opt_bench, &tmpl);
+        if (tmpl_count <= 0) {
+            fprintf(stderr, "Cannot load topology record %s!\n", opt_bench);
+            free(tmpl);
+            return -1;
+        }
+    }
+
+    /* Dual matching throughput: */
+    t0 = get_time_us();
+    iters = 0;
+    do {
+        hub_count = 0;
+        for (i=0; i<tmpl_count; i++) {
+            struct hub_info *slot = hub_new();
+            if (slot == NULL) {
+                free(tmpl);
+                return -1;
+            }
+            memcpy(slot, &tmpl[i], sizeof(*slot));
+            slot->actionable = 1;
+        }
+        usb_match_duals_and_count();
+        iters++;
+        elapsed = get_time_us() - t0;
+    } while (elapsed < 500000);
+    printf("bench: %d hubs (%d physical), matching: %d iters in %.0f ms, %.1f us/iter\n",
+        hub_count, hub_phys_count, iters, elapsed / 1000.0, (double)elapsed / iters);
+
+    /* Status formatting throughput: */
+    int64_t ports = 0;
+    t0 = get_time_us();
+    do {
+        struct out_buf ob = { NULL, 0, 0 };
+        for (i=0; i<hub_count; i++) {
+            int port;
+            for (port=1; port <= hubs[i].nports; port++) {
+                int port_status = (port & 1) ? 0x0503 : 0x0100;
+                const char *flags[20];
+                int nflags = port_status_flags(&hubs[i], port_status, flags, 20);
+                int n;
+                out_appendf(&ob, "  Port %d: %04x", port, port_status);
+                for (n=0; n<nflags; n++) {
+                    out_appendf(&ob, " %s", flags[n]);
+                }
+                out_appendf(&ob, "\n");
+                ports++;
+            }
+        }
+        free(ob.data);
+        elapsed = get_time_us() - t0;
+    } while (elapsed < 500000);
+    printf("bench: formatting: %lld ports in %.0f ms, %.2f us/port\n",
+        (long long)ports, elapsed / 1000.0, (double)elapsed / ports);
+
+    free(tmpl);
+    hub_count = 0;
+    hub_phys_count = 0;
+    return 0;
+}
+
+
+#if !defined(_WIN32)
+/*
+ * Live status export (--export): maintain an mmap-able file holding the
+ * current hub topology and the latest wPortStatus of every port, so
+ * external monitors can poll state with zero process spawns and zero
+ * USB traffic. The file is updated in place under a seqlock: seq is odd
+ * while an update is in progress, and readers retry until they observe
+ * the same even seq before and after copying:
+ *
+ *    do { s1 = hdr->seq; copy data; s2 = hdr->seq; }
+ *    while (s1 != s2 || (s1 & 1));
+ *
+ * Watch and daemon modes refresh the export after every change.
+ */
+
+#define EXPORT_MAGIC   0x4c424855  /* "UHBL" little-endian */
+#define EXPORT_VERSION 1
+
+struct export_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;        /* seqlock generation, odd while update is in progress */
+    uint32_t hub_count;  /* number of struct export_hub records following */
+    int64_t  updated_us; /* monotonic clock timestamp of last update */
+};
+
+struct export_hub {
+    char location[32];
+    char vendor[16];
+    char description[512];
+    int32_t nports;
+    int32_t super_speed;
+    int32_t port_status[MAX_HUB_PORTS+1]; /* wPortStatus bits, [0] unused, -1 unknown */
+};
+
+static struct export_header *export_hdr = NULL;
+static size_t export_size = 0;
+static int export_capacity = 0;
+
+static int export_map(int capacity)
+{
+    size_t size = sizeof(struct export_header) + capacity * sizeof(struct export_hub);
+    int fd = open(opt_export, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Cannot open export file");
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror("Cannot size export file");
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); /* the mapping keeps the file alive */
+    if (map == MAP_FAILED) {
+        perror("Cannot mmap export file");
+        return -1;
+    }
+    if (export_hdr) {
+        munmap(export_hdr, export_size);
+    }
+    export_hdr = map;
+    export_size = size;
+    export_capacity = capacity;
+    return 0;
+}
+
+static void export_update(void)
+{
+    int i;
+    if (strlen(opt_export) == 0)
+        return;
+    if (export_hdr == NULL || hub_count > export_capacity) {
+        int capacity = export_capacity ? export_capacity : 16;
+        while (capacity < hub_count) {
+            capacity *= 2;
+        }
+        if (export_map(capacity) != 0)
+            return;
+    }
+    struct export_header *hdr = export_hdr;
+    struct export_hub *ehubs = (struct export_hub *)(hdr + 1);
+    hdr->magic = EXPORT_MAGIC;
+    hdr->version = EXPORT_VERSION;
+    hdr->seq++; /* odd: update in progress */
+    __sync_synchronize();
+    for (i=0; i<hub_count; i++) {
+        struct hub_info *hub = &hubs[i];
+        struct export_hub *ehub = &ehubs[i];
+        int port;
+        snprintf(ehub->location, sizeof(ehub->location), "%s", hub->location);
+        snprintf(ehub->vendor, sizeof(ehub->vendor), "%s", hub->vendor);
+        snprintf(ehub->description, sizeof(ehub->description), "%s", hub_description(hub));
+        ehub->nports = hub->nports;
+        ehub->super_speed = hub->super_speed;
+        for (port = 0; port <= MAX_HUB_PORTS; port++) {
+            ehub->port_status[port] = -1;
+        }
+        if (hub->dev == NULL)
             continue;
+        struct libusb_device_handle *devh = NULL;
+        if (libusb_open(hub->dev, &devh) == 0) {
+            int status[MAX_HUB_PORTS+1];
+            get_ports_status(devh, hub, 0, status);
+            for (port=1; port <= hub->nports && port <= MAX_HUB_PORTS; port++) {
+                ehub->port_status[port] = status[port];
+            }
+            libusb_close(devh);
         }
-        info.actionable = 1;
-        if (strlen(opt_search) > 0) {
-            /* Search by attached device description */
-            info.actionable = 0;
-            struct libusb_device * udev;
-            int k = 0;
-            while ((udev = usb_devs[k++]) != NULL) {
-                uint8_t dev_pn[MAX_HUB_CHAIN];
-                uint8_t dev_bus = libusb_get_bus_number(udev);
-                /* only match devices on the same bus: */
-                if (dev_bus != info.bus) continue;
-                int dev_plen = get_port_numbers(udev, dev_pn, sizeof(dev_pn));
-                if ((dev_plen == info.pn_len + 1) &&
-                    (memcmp(info.port_numbers, dev_pn, info.pn_len) == 0))
-                {
-                    struct descriptor_strings ds;
-                    bzero(&ds, sizeof(ds));
-                    rc = get_device_description(udev, &ds);
-                    if (rc != 0)
-                        break;
-                    if (strstr(ds.description, opt_search)) {
-                        info.actionable = 1;
-                        opt_ports &= 1 << (dev_pn[dev_plen-1] - 1);
-                        break;
-                    }
+    }
+    hdr->hub_count = hub_count;
+    hdr->updated_us = get_time_us();
+    __sync_synchronize();
+    hdr->seq++; /* even: consistent snapshot published */
+}
+
+static void export_close(void)
+{
+    if (export_hdr) {
+        munmap(export_hdr, export_size);
+        export_hdr = NULL;
+        export_size = 0;
+        export_capacity = 0;
+    }
+}
+#endif
+
+
+/*
+ * Watch mode (-W): instead of rescan polling, register a libusb hotplug
+ * callback and emit one status line per topology change, querying only
+ * the device that arrived or left. The hubs[] array is maintained
+ * incrementally so later events still know about all hubs.
+ *
+ * Blocking libusb calls are not allowed inside the hotplug callback,
+ * so events are queued there and processed after handle_events returns.
+ */
+
+#define WATCH_QUEUE_SIZE 64
+
+struct watch_event {
+    struct libusb_device *dev;
+    int arrived;
+};
+
+static struct watch_event watch_queue[WATCH_QUEUE_SIZE];
+static int watch_queue_head = 0;
+static int watch_queue_tail = 0;
+
+static int watch_hotplug_callback(libusb_context *ctx, libusb_device *dev,
+    libusb_hotplug_event event, void *user_data)
+{
+    (void)ctx;
+    (void)user_data;
+    int next = (watch_queue_tail + 1) % WATCH_QUEUE_SIZE;
+    if (next == watch_queue_head) {
+        return 0; /* queue full - drop event rather than block libusb */
+    }
+    watch_queue[watch_queue_tail].dev = libusb_ref_device(dev);
+    watch_queue[watch_queue_tail].arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    watch_queue_tail = next;
+    return 0;
+}
+
+static void watch_handle_event(struct libusb_device *dev, int arrived)
+{
+    uint8_t pn[MAX_HUB_CHAIN];
+    char location[32];
+    uint8_t bus = libusb_get_bus_number(dev);
+    int pn_len = get_port_numbers(dev, pn, sizeof(pn));
+    if (pn_len < 0) {
+        pn_len = 0;
+    }
+    format_location(location, sizeof(location), bus, pn, pn_len);
+
+    if (arrived) {
+#if !defined(UHUBCTL_MINIMAL)
+        struct descriptor_strings ds;
+        bzero(&ds, sizeof(ds));
+        get_device_description(dev, &ds);
+        printf("Connected: %s [%s]\n", location, ds.description);
+#else
+        printf("Connected: %s\n", location);
+#endif
+
+        /* If a hub arrived, track it so its ports are known from now on: */
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(dev, &desc) == 0 &&
+            desc.bDeviceClass == LIBUSB_CLASS_HUB)
+        {
+            struct hub_info info;
+            bzero(&info, sizeof(info));
+            if (get_hub_info(dev, &info) == 0 &&
+                (info.lpsm == HUB_CHAR_INDV_PORT_LPSM || opt_force))
+            {
+#if !defined(UHUBCTL_MINIMAL)
+                memcpy(&info.ds, &ds, sizeof(ds));
+#endif
+                struct hub_info *slot = hub_new();
+                if (slot != NULL) {
+                    libusb_ref_device(dev); /* hubs[] keeps a reference now */
+                    memcpy(slot, &info, sizeof(info));
+#if defined(__gnu_linux__) || defined(__linux__)
+                    /* The slot address may be a reused one - drop fds
+                     * cached under the hub that lived there before: */
+                    sysfs_cache_clear();
+#endif
+                    refilter_hubs();
                 }
             }
         }
-        if (strlen(opt_location) > 0) {
-            if (strcasecmp(opt_location, info.location)) {
-                info.actionable = 0;
+    } else {
+        printf("Disconnected: %s\n", location);
+        int i;
+        for (i=0; i<hub_count; i++) {
+            if (hubs[i].dev != dev)
+                continue;
+            /* Hubs added by watch mode hold their own device reference;
+             * hubs from the initial scan are owned by usb_devs[]: */
+            int from_scan = 0;
+            int j = 0;
+            struct libusb_device *udev;
+            while (usb_devs && (udev = usb_devs[j++]) != NULL) {
+                if (udev == dev) {
+                    from_scan = 1;
+                    break;
+                }
+            }
+            if (!from_scan) {
+                libusb_unref_device(dev);
             }
+            memmove(&hubs[i], &hubs[i+1], (hub_count - i - 1) * sizeof(hubs[0]));
+            hub_count--;
+#if defined(__gnu_linux__) || defined(__linux__)
+            /* Entries are keyed by hub address and every hub past i
+             * just moved - cached fds would alias the wrong hub: */
+            sysfs_cache_clear();
+#endif
+            refilter_hubs();
+            break;
         }
-        if (opt_level > 0) {
-            if (opt_level != info.pn_len + 1) {
-                info.actionable = 0;
+#if !defined(UHUBCTL_MINIMAL)
+        desc_cache_forget(dev);
+#endif
+    }
+    fflush(stdout);
+}
+
+static int watch_loop(void)
+{
+    libusb_hotplug_callback_handle callback_handle;
+    int rc;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "Hotplug events are not supported on this platform!\n");
+        return -1;
+    }
+
+    history_enable();
+#if !defined(_WIN32)
+    signal(SIGUSR1, history_signal);
+#endif
+
+    /* Show initial state, then only react to changes: */
+    rc = rescan_hubs();
+    if (rc > 0) {
+        run_action();
+    }
+#if !defined(_WIN32)
+    export_update();
+#endif
+
+    rc = libusb_hotplug_register_callback(NULL,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        0,
+        LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        watch_hotplug_callback, NULL, &callback_handle
+    );
+    if (rc != 0) {
+        fprintf(stderr, "Cannot register hotplug callback!\n");
+        return -1;
+    }
+    printf("Watching for USB topology changes...\n");
+    fflush(stdout);
+
+    for (;;) {
+        rc = libusb_handle_events(NULL);
+#if !defined(_WIN32)
+        if (hist_dump_requested) {
+            hist_dump_requested = 0;
+            history_dump();
+            if (rc == LIBUSB_ERROR_INTERRUPTED) {
+                rc = 0; /* interrupted by our own SIGUSR1, keep watching */
             }
         }
-        if (strlen(opt_vendor) > 0) {
-            if (strncasecmp(opt_vendor, info.vendor, strlen(opt_vendor))) {
-                info.actionable = 0;
+#endif
+        if (rc != 0) {
+            break;
+        }
+        int handled = 0;
+        while (watch_queue_head != watch_queue_tail) {
+            struct watch_event *event = &watch_queue[watch_queue_head];
+            watch_queue_head = (watch_queue_head + 1) % WATCH_QUEUE_SIZE;
+            watch_handle_event(event->dev, event->arrived);
+            libusb_unref_device(event->dev);
+            handled++;
+        }
+#if !defined(_WIN32)
+        if (handled > 0) {
+            export_update();
+        }
+#else
+        (void)handled;
+#endif
+    }
+    libusb_hotplug_deregister_callback(NULL, callback_handle);
+#if !defined(_WIN32)
+    export_close();
+#endif
+    return rc;
+}
+
+
+#if !defined(_WIN32)
+/*
+ * Daemon mode: keep the libusb context and hubs[] array warm and
+ * accept commands over a Unix domain socket. Each command is one line
+ * using the same syntax as regular command line options, e.g.:
+ *
+ *    echo "-l 1-2.3 -p 2 -a cycle" | nc -U /run/uhubctl.sock
+ *
+ * A full rescan is performed only when hub filtering options change
+ * (or on explicit `rescan` command) - otherwise cached hub topology is
+ * reused and an action costs only its own control transfers.
+ * Special commands: `rescan` forces re-enumeration, `exit` stops the
+ * daemon, `history` dumps recorded port status transitions (also
+ * available via SIGUSR1, printed to the daemon's own stdout).
+ */
+
+static int daemon_loop(void)
+{
+    int listen_fd;
+    struct sockaddr_un addr;
+    char scan_filters[256] = "";
+    int scan_valid = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, history_signal);
+    history_enable();
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("Cannot create daemon socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opt_daemon);
+    unlink(opt_daemon);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 4) < 0)
+    {
+        perror("Cannot listen on daemon socket");
+        close(listen_fd);
+        return -1;
+    }
+    fprintf(stderr, "uhubctl daemon listening on %s\n", opt_daemon);
+    export_update();
+
+    for (;;) {
+        char line[1024];
+        char *args[64];
+        char *token;
+        int nargs = 1;
+        int force_rescan = 0;
+        int stdout_copy;
+        int rc;
+
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                if (hist_dump_requested) {
+                    hist_dump_requested = 0;
+                    history_dump();
+                }
+                continue;
             }
+            perror("Daemon socket accept failed");
+            break;
         }
-        memcpy(&hubs[hub_count], &info, sizeof(info));
-        if (hub_count < MAX_HUBS) {
-            hub_count++;
-        } else {
-            /* That should be impossible - but we don't want to crash! */
-            fprintf(stderr, "Too many hubs!");
+        ssize_t len = read(conn, line, sizeof(line)-1);
+        if (len <= 0) {
+            close(conn);
+            continue;
+        }
+        line[len] = 0;
+
+        args[0] = (char *)"uhubctl";
+        token = strtok(line, " \t\r\n");
+        if (token && strcmp(token, "exit") == 0) {
+            close(conn);
             break;
         }
+        if (token && strcmp(token, "history") == 0) {
+            /* Dump transition history into this connection and keep serving: */
+            fflush(stdout);
+            stdout_copy = dup(STDOUT_FILENO);
+            dup2(conn, STDOUT_FILENO);
+            history_dump();
+            fflush(stdout);
+            dup2(stdout_copy, STDOUT_FILENO);
+            close(stdout_copy);
+            close(conn);
+            continue;
+        }
+        while (token && nargs < 63) {
+            if (strcmp(token, "rescan") == 0) {
+                force_rescan = 1;
+            } else {
+                args[nargs++] = token;
+            }
+            token = strtok(NULL, " \t\r\n");
+        }
+        args[nargs] = NULL;
+
+        reset_options();
+#if defined(__GLIBC__)
+        optind = 0; /* forces getopt_long to reinitialize */
+#else
+        optreset = 1;
+        optind = 1;
+#endif
+
+        /* Redirect stdout to the client for the duration of this command: */
+        fflush(stdout);
+        stdout_copy = dup(STDOUT_FILENO);
+        dup2(conn, STDOUT_FILENO);
+
+        rc = parse_options(nargs, args);
+        if (rc == 0) {
+            char filters[256];
+            snprintf(filters, sizeof(filters), "%s|%d|%s|%d|%d|%d",
+                opt_location, opt_level, opt_vendor,
+                opt_exact, opt_force, opt_nodesc
+            );
+            if (force_rescan || !scan_valid || strlen(opt_search) > 0 ||
+                strcmp(filters, scan_filters) != 0)
+            {
+                rc = rescan_hubs();
+                snprintf(scan_filters, sizeof(scan_filters), "%s", filters);
+                /* search constrains opt_ports, do not reuse its scan results: */
+                scan_valid = (rc > 0) && (strlen(opt_search) == 0);
+            } else {
+                refilter_hubs();
+                rc = hub_phys_count;
+            }
+            if (rc <= 0) {
+                printf("No compatible devices detected%s%s!\n",
+                    strlen(opt_location) ? " at location " : "",
+                    opt_location
+                );
+            } else {
+                run_action();
+            }
+        }
+
+        fflush(stdout);
+        dup2(stdout_copy, STDOUT_FILENO);
+        close(stdout_copy);
+        close(conn);
+        export_update();
+    }
+    close(listen_fd);
+    unlink(opt_daemon);
+    export_close();
+    return 0;
+}
+#endif
+
+
+/*
+ * Public library API (see uhubctl.h).
+ * Thin non-static wrappers over the discovery and control machinery
+ * above, so controller daemons can link against libuhubctl and keep
+ * one warm libusb context instead of forking the CLI per operation.
+ * struct uhubctl_hub is struct hub_info behind an opaque pointer.
+ */
+
+int uhubctl_init(void)
+{
+    int64_t pt = prof_start();
+    int rc = libusb_init(NULL);
+    prof_end(PROF_INIT, pt);
+    if (rc < 0) {
+        return rc;
+    }
+    is_rpi_4b = check_computer_model("Raspberry Pi 4 Model B");
+    is_rpi_5  = check_computer_model("Raspberry Pi 5");
+    return 0;
+}
+
+
+void uhubctl_exit(void)
+{
+    if (usb_devs) {
+#if !defined(UHUBCTL_MINIMAL)
+        desc_cache_clear();
+#endif
+        topo_index_clear();
+#if defined(__gnu_linux__) || defined(__linux__)
+        sysfs_cache_clear();
+#endif
+        libusb_free_device_list(usb_devs, 1);
+        usb_devs = NULL;
     }
-    if (!opt_exact) {
-        /* Handle USB2/3 duality: */
-        for (i=0; i<hub_count; i++) {
-            /* Check only actionable hubs: */
-            if (hubs[i].actionable != 1)
-                continue;
-            /* Must have non empty container ID: */
-            if (strlen(hubs[i].container_id) == 0)
-                continue;
-            int best_match = -1;
-            int best_score = -1;
-            for (j=0; j<hub_count; j++) {
-                if (i==j)
-                    continue;
+    free(hubs);
+    hubs = NULL;
+    hub_count = 0;
+    hub_capacity = 0;
+    hub_phys_count = 0;
+    libusb_exit(NULL);
+}
 
-                /* Find hub which is USB2/3 dual to the hub above */
 
-                /* Hub and its dual must be different types: one USB2, another USB3: */
-                if (hubs[i].super_speed == hubs[j].super_speed)
-                    continue;
+int uhubctl_scan(void)
+{
+    int rc = rescan_hubs();
+    return rc < 0 ? rc : hub_count;
+}
 
-                /* Must have non empty container ID: */
-                if (strlen(hubs[j].container_id) == 0)
-                    continue;
 
-                /* Per USB 3.0 spec chapter 11.2, container IDs must match: */
-                if (strcmp(hubs[i].container_id, hubs[j].container_id) != 0)
-                    continue;
+struct uhubctl_hub *uhubctl_hub_at(int index)
+{
+    if (index < 0 || index >= hub_count) {
+        return NULL;
+    }
+    return (struct uhubctl_hub *)&hubs[index];
+}
 
-                /* At this point, it should be enough to claim a match.
-                 * However, some devices use hardcoded non-unique container ID.
-                 * We should do few more checks below if multiple such devices are present.
-                 */
 
-                /* Hubs should have the same number of ports */
-                if (hubs[i].nports != hubs[j].nports) {
-                    /* Except for some weird hubs like Apple mini-dock (has 2 usb2 + 1 usb3 ports) */
-                    if (hubs[i].nports + hubs[j].nports > 3) {
-                        continue;
-                    }
-                }
+const char *uhubctl_hub_location(struct uhubctl_hub *hub)
+{
+    return ((struct hub_info *)hub)->location;
+}
 
-                /* If serial numbers are both present, they must match: */
-                if ((strlen(hubs[i].ds.serial) > 0 && strlen(hubs[j].ds.serial) > 0) &&
-                    strcmp(hubs[i].ds.serial, hubs[j].ds.serial) != 0)
-                {
-                    continue;
-                }
 
-                /* We have first possible candidate, but need to keep looking for better one */
+const char *uhubctl_hub_vendor(struct uhubctl_hub *hub)
+{
+    return ((struct hub_info *)hub)->vendor;
+}
 
-                if (best_score < 1) {
-                    best_score = 1;
-                    best_match = j;
-                }
 
-                /* Checks for various levels of USB2 vs USB3 path similarity... */
+const char *uhubctl_hub_description(struct uhubctl_hub *hub)
+{
+#if defined(UHUBCTL_MINIMAL)
+    (void)hub;
+    return "";
+#else
+    return hub_description((struct hub_info *)hub);
+#endif
+}
 
-                uint8_t* p1 = hubs[i].port_numbers;
-                uint8_t* p2 = hubs[j].port_numbers;
-                int l1 = hubs[i].pn_len;
-                int l2 = hubs[j].pn_len;
-                int s1 = hubs[i].super_speed;
-                int s2 = hubs[j].super_speed;
 
-                /* Check if port path is the same after removing top level (needed for M1 Macs): */
-                if (l1 >= 1 && l1 == l2 && memcmp(p1 + 1, p2 + 1, l1 - 1)==0) {
-                    if (best_score < 2) {
-                        best_score = 2;
-                        best_match = j;
-                    }
-                }
+int uhubctl_hub_nports(struct uhubctl_hub *hub)
+{
+    return ((struct hub_info *)hub)->nports;
+}
 
-                /* Raspberry Pi 4B hack (USB2 hub is one level deeper than USB3): */
-                if (is_rpi_4b && l1 + s1 == l2 + s2 && l1 >= s2 && memcmp(p1 + s2, p2 + s1, l1 - s2)==0) {
-                    if (best_score < 3) {
-                        best_score = 3;
-                        best_match = j;
-                    }
-                }
-                /* Check if port path is exactly the same: */
-                if (l1 == l2 && memcmp(p1, p2, l1)==0) {
-                    if (best_score < 4) {
-                        best_score = 4;
-                        best_match = j;
-                    }
-                    /* Give even higher priority if `usb2bus + 1 == usb3bus` (Linux specific): */
-                    if (hubs[i].bus - s1 == hubs[j].bus - s2) {
-                        if (best_score < 5) {
-                            best_score = 5;
-                            best_match = j;
-                        }
-                    }
-                }
-            }
-            if (best_match >= 0) {
-                if (!hubs[best_match].actionable) {
-                    /* Use 2 to signify that this is derived dual device */
-                    hubs[best_match].actionable = 2;
-                }
-            }
-        }
-    }
-    hub_phys_count = 0;
-    for (i=0; i<hub_count; i++) {
-        if (!hubs[i].actionable)
-            continue;
-        if (!hubs[i].super_speed || opt_exact) {
-            hub_phys_count++;
-        }
+
+int uhubctl_hub_is_super_speed(struct uhubctl_hub *hub)
+{
+    return ((struct hub_info *)hub)->super_speed;
+}
+
+
+int uhubctl_get_port_status(struct uhubctl_hub *hub, int port)
+{
+    struct hub_info *info = (struct hub_info *)hub;
+    struct libusb_device_handle *devh = NULL;
+    int rc = libusb_open(info->dev, &devh);
+    if (rc != 0) {
+        return rc;
     }
-    if (perm_ok == 0 && hub_phys_count == 0) {
-#if defined(__gnu_linux__) || defined(__linux__)
-        if (geteuid() != 0) {
-            fprintf(stderr,
-                "There were permission problems while accessing USB.\n"
-                "Follow https://git.io/JIB2Z for a fix!\n"
-            );
-        }
-#endif
-        return LIBUSB_ERROR_ACCESS;
+    rc = get_port_status(devh, port);
+    libusb_close(devh);
+    return rc;
+}
+
+
+int uhubctl_set_port_power(struct uhubctl_hub *hub, int port, int on)
+{
+    struct hub_info *info = (struct hub_info *)hub;
+    struct libusb_device_handle *devh = NULL;
+    int rc = libusb_open(info->dev, &devh);
+    if (rc != 0) {
+        return rc;
     }
-    return hub_phys_count;
+    rc = set_port_status(devh, info, port, on);
+    libusb_close(devh);
+    return rc < 0 ? rc : 0;
 }
 
 
-int main(int argc, char *argv[])
+int uhubctl_main(int argc, char *argv[])
 {
     int rc;
-    int c = 0;
-    int option_index = 0;
 
-    for (;;) {
-        c = getopt_long(argc, argv, short_options, long_options, &option_index);
-        if (c == -1)
-            break;  /* no more options left */
-        switch (c) {
-        case 0:
-            /* If this option set a flag, do nothing else now. */
-            if (long_options[option_index].flag != 0)
-                break;
-            printf("option %s", long_options[option_index].name);
-            if (optarg)
-                printf(" with arg %s", optarg);
-            printf("\n");
-            break;
-        case 'l':
-            snprintf(opt_location, sizeof(opt_location), "%s", optarg);
-            break;
-        case 'L':
-            opt_level = atoi(optarg);
-            break;
-        case 'n':
-            snprintf(opt_vendor, sizeof(opt_vendor), "%s", optarg);
-            break;
-        case 's':
-            snprintf(opt_search, sizeof(opt_search), "%s", optarg);
-            break;
-        case 'p':
-            if (!strcasecmp(optarg, "all")) { /* all ports is the default */
-                break;
-            }
-            if (strlen(optarg)) {
-                opt_ports = ports2bitmap(optarg);
-            }
-            break;
-        case 'a':
-            if (!strcasecmp(optarg, "off")   || !strcasecmp(optarg, "0")) {
-                opt_action = POWER_OFF;
-            }
-            if (!strcasecmp(optarg, "on")    || !strcasecmp(optarg, "1")) {
-                opt_action = POWER_ON;
-            }
-            if (!strcasecmp(optarg, "cycle") || !strcasecmp(optarg, "2")) {
-                opt_action = POWER_CYCLE;
-            }
-            if (!strcasecmp(optarg, "toggle") || !strcasecmp(optarg, "3")) {
-                opt_action = POWER_TOGGLE;
-            }
-            if (!strcasecmp(optarg, "flash") || !strcasecmp(optarg, "4")) {
-                opt_action = POWER_FLASH;
-            }
-            break;
-        case 'd':
-            opt_delay = atof(optarg);
-            break;
-        case 'r':
-            opt_repeat = atoi(optarg);
-            break;
-        case 'f':
-            opt_force = 1;
-            break;
-        case 'N':
-            opt_nodesc = 1;
-            break;
-#if defined(__gnu_linux__) || defined(__linux__)
-        case 'S':
-            opt_nosysfs = 1;
-            break;
-#endif
-        case 'e':
-            opt_exact = 1;
-            break;
-        case 'R':
-            opt_reset = 1;
-            break;
-        case 'w':
-            opt_wait = atoi(optarg);
-            break;
-        case 'v':
-            printf("%s\n", PROGRAM_VERSION);
-            exit(0);
-            break;
-        case 'h':
-            print_usage();
-            exit(1);
-            break;
-        case '?':
-            /* getopt_long has already printed an error message here */
-            fprintf(stderr, "Run with -h to get usage info.\n");
-            exit(1);
-            break;
-        default:
-            abort();
-        }
-    }
-    if (optind < argc) {
-        /* non-option parameters are found? */
-        fprintf(stderr, "Invalid command line syntax!\n");
-        fprintf(stderr, "Run with -h to get usage info.\n");
-        exit(1);
+    rc = parse_options(argc, argv);
+    if (rc != 0) {
+        /* version (1) or help (2) was requested, or options were not valid (-1): */
+        exit(rc == 1 ? 0 : 1);
     }
 
-    rc = libusb_init(NULL);
+    rc = uhubctl_init();
     if (rc < 0) {
         fprintf(stderr,
             "Error initializing USB!\n"
@@ -1209,19 +5147,37 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    rc = libusb_get_device_list(NULL, &usb_devs);
-    if (rc < 0) {
-        fprintf(stderr,
-            "Cannot enumerate USB devices!\n"
-        );
-        rc = 1;
+    if (strlen(opt_cache) > 0) {
+        load_hub_cache();
+#if !defined(UHUBCTL_MINIMAL)
+        load_neg_cache();
+#endif
+        load_settle_cache();
+    }
+
+    if (strlen(opt_bench) > 0) {
+        rc = bench_loop() < 0 ? 1 : 0;
         goto cleanup;
     }
 
-    is_rpi_4b = check_computer_model("Raspberry Pi 4 Model B");
-    is_rpi_5  = check_computer_model("Raspberry Pi 5");
+    if (strlen(opt_batch) > 0) {
+        rc = batch_loop() < 0 ? 1 : 0;
+        goto cleanup;
+    }
 
-    rc = usb_find_hubs();
+    if (opt_watch) {
+        rc = watch_loop() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+
+#if !defined(_WIN32)
+    if (strlen(opt_daemon) > 0) {
+        rc = daemon_loop() < 0 ? 1 : 0;
+        goto cleanup;
+    }
+#endif
+
+    rc = rescan_hubs();
     if (rc <= 0) {
         fprintf(stderr,
             "No compatible devices detected%s%s!\n"
@@ -1233,91 +5189,22 @@ int main(int argc, char *argv[])
         goto cleanup;
     }
 
-    if (hub_phys_count > 1 && opt_action >= 0) {
-        fprintf(stderr,
-            "Error: changing port state for multiple hubs at once is not supported.\n"
-            "Use -l to limit operation to one hub!\n"
-        );
-        exit(1);
-    }
-    int k; /* k=0 for power OFF, k=1 for power ON */
-    for (k=0; k<2; k++) { /* up to 2 power actions - off/on */
-        if (k == 0 && opt_action == POWER_ON )
-            continue;
-        if (k == 1 && opt_action == POWER_OFF)
-            continue;
-        if (k == 1 && opt_action == POWER_KEEP)
-            continue;
-        /* if toggle requested, do it only once when `k == 0` */
-        if (k == 1 && opt_action == POWER_TOGGLE)
-            continue;
-        int i;
-        for (i=0; i<hub_count; i++) {
-            if (hubs[i].actionable == 0)
-                continue;
-            printf("Current status for hub %s [%s]\n",
-                hubs[i].location, hubs[i].ds.description
-            );
-            print_port_status(&hubs[i], opt_ports);
-            if (opt_action == POWER_KEEP) { /* no action, show status */
-                continue;
-            }
-            struct libusb_device_handle * devh = NULL;
-            rc = libusb_open(hubs[i].dev, &devh);
-            if (rc == 0) {
-                /* will operate on these ports */
-                int ports = ((1 << hubs[i].nports) - 1) & opt_ports;
-                int should_be_on = k;
-                if (opt_action == POWER_FLASH) {
-                    should_be_on = !should_be_on;
-                }
-
-                int port;
-                for (port=1; port <= hubs[i].nports; port++) {
-                    if ((1 << (port-1)) & ports) {
-                        int port_status = get_port_status(devh, port);
-                        int power_mask = hubs[i].super_speed ? USB_SS_PORT_STAT_POWER
-                                                             : USB_PORT_STAT_POWER;
-                        int is_on = (port_status & power_mask) != 0;
-
-                        if (opt_action == POWER_TOGGLE) {
-                            should_be_on = !is_on;
-                        }
-
-                        if (is_on != should_be_on) {
-                            rc = set_port_status(devh, &hubs[i], port, should_be_on);
-                        }
-                    }
-                }
-                /* USB3 hubs need extra delay to actually turn off: */
-                if (k==0 && hubs[i].super_speed)
-                    sleep_ms(150);
-                printf("Sent power %s request\n", should_be_on ? "on" : "off");
-                printf("New status for hub %s [%s]\n",
-                    hubs[i].location, hubs[i].ds.description
-                );
-                print_port_status(&hubs[i], opt_ports);
-
-                if (k == 1 && opt_reset == 1) {
-                    printf("Resetting hub...\n");
-                    rc = libusb_reset_device(devh);
-                    if (rc < 0) {
-                        perror("Reset failed!\n");
-                    } else {
-                        printf("Reset successful!\n");
-                    }
-                }
-            }
-            libusb_close(devh);
+    if (strlen(opt_record) > 0) {
+        if (record_hubs(opt_record) != 0) {
+            fprintf(stderr, "Cannot write topology record %s!\n", opt_record);
         }
-        if (k == 0 && (opt_action == POWER_CYCLE || opt_action == POWER_FLASH))
-            sleep_ms((int)(opt_delay * 1000));
     }
-    rc = 0;
+
+    rc = run_action() == 0 ? 0 : 1;
 cleanup:
-    if (usb_devs)
-        libusb_free_device_list(usb_devs, 1);
-    usb_devs = NULL;
-    libusb_exit(NULL);
+    if (strlen(opt_cache) > 0) {
+        save_hub_cache();
+#if !defined(UHUBCTL_MINIMAL)
+        save_neg_cache();
+#endif
+        save_settle_cache();
+    }
+    uhubctl_exit();
+    prof_report();
     return rc;
 }
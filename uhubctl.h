@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009-2024 Vadim Mikhailov
+ *
+ * libuhubctl: embeddable API to control USB port power
+ * for USB hubs that support per-port power switching.
+ *
+ * This file can be distributed under the terms and conditions of the
+ * GNU General Public License version 2.
+ *
+ */
+
+#ifndef UHUBCTL_H
+#define UHUBCTL_H
+
+/*
+ * API version, incremented on incompatible changes.
+ * Check it at compile time if you depend on specific behavior.
+ */
+#define UHUBCTL_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque handle for one discovered smart hub */
+struct uhubctl_hub;
+
+/*
+ * Initialize the library (libusb context, platform detection).
+ * Returns 0 on success and negative libusb error code otherwise.
+ * Must be called before any other function below.
+ */
+int uhubctl_init(void);
+
+/*
+ * Release all library resources. No library calls are valid after this.
+ */
+void uhubctl_exit(void);
+
+/*
+ * Enumerate USB devices and discover smart hubs.
+ * Returns number of discovered hubs (possibly 0)
+ * or negative libusb error code on failure.
+ * Invalidates all hub handles from previous scans.
+ */
+int uhubctl_scan(void);
+
+/*
+ * Get hub handle by index, 0 <= index < uhubctl_scan() result.
+ * Returns NULL if index is out of range.
+ * Handles stay valid until the next uhubctl_scan() or uhubctl_exit().
+ */
+struct uhubctl_hub *uhubctl_hub_at(int index);
+
+/* Hub attributes. Returned strings are owned by the library. */
+const char *uhubctl_hub_location(struct uhubctl_hub *hub);    /* e.g. "1-2.3" */
+const char *uhubctl_hub_vendor(struct uhubctl_hub *hub);      /* e.g. "2109:0817" */
+const char *uhubctl_hub_description(struct uhubctl_hub *hub);
+int uhubctl_hub_nports(struct uhubctl_hub *hub);
+int uhubctl_hub_is_super_speed(struct uhubctl_hub *hub);
+
+/*
+ * Read status of given port (1-based), as USB hub class wPortStatus bits.
+ * Returns negative libusb error code on failure.
+ */
+int uhubctl_get_port_status(struct uhubctl_hub *hub, int port);
+
+/*
+ * Switch power of given port (1-based) on (1) or off (0).
+ * Returns 0 on success and negative libusb error code otherwise.
+ */
+int uhubctl_set_port_power(struct uhubctl_hub *hub, int port, int on);
+
+/*
+ * Entry point of the uhubctl command line tool.
+ * The CLI is a thin main() calling this, see main.c.
+ */
+int uhubctl_main(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* UHUBCTL_H */